@@ -0,0 +1,101 @@
+//! \file PageArena.h
+//! \brief File containing the PageArena template class.
+//!
+//! This file implements a fixed number of equally sized slots backed by one
+//! anonymous memory mapping. Every slot starts on a page boundary, so the
+//! memory behind a single slot can be handed back to the operating system
+//! without unmapping the rest of the arena.
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+//! \brief Page-aligned slots that are allocated once and reused.
+//!
+//! The arena only maps and unmaps memory; it never constructs or destroys
+//! elements. Callers construct a slot with placement new before first use
+//! and after every release().
+//!
+//! \tparam T Slot type. Must be trivially destructible.
+template <typename T>
+class PageArena
+{
+  static_assert(std::is_trivially_destructible<T>::value,
+                "slots are unmapped without running destructors");
+
+public:
+  PageArena() = default;
+  PageArena(const PageArena&) = delete;
+  PageArena& operator=(const PageArena&) = delete;
+
+  ~PageArena()
+  {
+    unmap();
+  }
+
+  //! \brief Makes room for count slots.
+  //!
+  //! Remaps only when count or the slot size differs from the current one,
+  //! which discards every slot. Throws std::bad_alloc if the mapping fails.
+  //!
+  //! \param used_bytes Bytes of each slot that are ever touched. Less than
+  //! sizeof(T) suits a T that ends in an array only partly in use; the rest
+  //! of it falls outside the slot and must be left alone.
+  //! \return Whether the arena was remapped.
+  bool resize(std::size_t count, std::size_t used_bytes = sizeof(T))
+  {
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const std::size_t slot_bytes = (used_bytes + page - 1) / page * page;
+    if (count == _count && slot_bytes == _slot_bytes) {
+      return false;
+    }
+    unmap();
+    if (count == 0) {
+      return true;
+    }
+
+    _slot_bytes = slot_bytes;
+    // Slots are often only partly touched, so no swap is reserved for the
+    // whole mapping up front.
+    void* base = mmap(nullptr, count * _slot_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    _base = static_cast<char*>(base);
+    _count = count;
+    return true;
+  }
+
+  std::size_t size() const { return _count; }
+
+  T& operator[](std::size_t i) { return *reinterpret_cast<T*>(_base + i * _slot_bytes); }
+  const T& operator[](std::size_t i) const { return *reinterpret_cast<const T*>(_base + i * _slot_bytes); }
+
+  //! \brief Returns the pages behind slot i to the operating system.
+  //!
+  //! The slot stays mapped; its contents are unspecified until it is
+  //! constructed again.
+  void release(std::size_t i)
+  {
+    madvise(_base + i * _slot_bytes, _slot_bytes, MADV_DONTNEED);
+  }
+
+private:
+  void unmap()
+  {
+    if (_base) {
+      munmap(_base, _count * _slot_bytes);
+    }
+    _base = nullptr;
+    _count = 0;
+  }
+
+private:
+  char* _base = nullptr;
+  std::size_t _count = 0;
+  std::size_t _slot_bytes = 0;
+};
@@ -0,0 +1,70 @@
+//! \file TripleBuffer.h
+//! \brief File containing the TripleBuffer template class.
+//!
+//! This file implements a lock-free hand-off of whole values from one
+//! producer thread to one consumer thread, so that neither ever waits for
+//! the other to finish with a buffer.
+#pragma once
+
+#include <atomic>
+
+//! \brief Three slots: one the producer writes, one the consumer reads and a
+//! spare that the two swap through a single atomic.
+//!
+//! publish() swaps the producer's slot with the spare and marks it fresh;
+//! update() swaps the consumer's slot with a fresh spare. Each thread only
+//! ever touches the slot it owns, so values are never copied and never read
+//! while being written. A slot the producer gets back holds an older value,
+//! not necessarily the one it published last, so producers that update
+//! slots in place must track what each one holds.
+//!
+//! Only one thread may call back() and publish(), and only one other thread
+//! front(), fresh() and update().
+//!
+//! \tparam T Slot type. Must be default constructible.
+template <typename T>
+class TripleBuffer
+{
+public:
+  TripleBuffer() = default;
+  TripleBuffer(const TripleBuffer&) = delete;
+  TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+  //! \brief The slot the producer writes.
+  T& back() { return _slots[_back]; }
+
+  //! \brief Makes back() the newest value and hands the producer the spare.
+  void publish()
+  {
+    _back = _spare.exchange(_back | _fresh, std::memory_order_acq_rel) & _index;
+  }
+
+  //! \brief The slot the consumer reads.
+  const T& front() const { return _slots[_front]; }
+
+  //! \brief Whether a value was published since the last update().
+  bool fresh() const { return _spare.load(std::memory_order_relaxed) & _fresh; }
+
+  //! \brief Makes the newest published value the front, if there is one.
+  //!
+  //! \return Whether front() changed.
+  bool update()
+  {
+    if (!fresh()) {
+      return false;
+    }
+    _front = _spare.exchange(_front, std::memory_order_acq_rel) & _index;
+    return true;
+  }
+
+private:
+  static constexpr unsigned _index = 3;
+  static constexpr unsigned _fresh = 4;
+
+  T _slots[3];
+  unsigned _back = 0;
+  unsigned _front = 1;
+  //! Index of the spare slot, with _fresh set while it holds a value the
+  //! consumer has not seen.
+  std::atomic<unsigned> _spare{2};
+};
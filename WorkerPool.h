@@ -0,0 +1,166 @@
+//! \file WorkerPool.h
+//! \brief File containing the WorkerPool class.
+//!
+//! This file implements a fixed set of long-lived worker threads that are
+//! handed one job per frame, so that steady-state frames never create or
+//! join threads.
+#pragma once
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cassert>
+
+//! \brief Fixed set of threads that all run the same job once per frame.
+//!
+//! submit() hands a job to every worker and wait() blocks the caller until
+//! each worker has returned from it. Between frames the workers sleep on a
+//! condition variable, so an idle pool does not show up as CPU utilization.
+//!
+//! Only one job may be in flight at a time, and only one thread may call
+//! submit() and wait().
+class WorkerPool
+{
+public: // Typedefs
+
+  //! \brief Job signature. The argument is the worker index in [0, size()).
+  //!
+  //! Keep captures small (a pointer or two) so that the std::function can
+  //! store them inline and submitting a job does not allocate.
+  typedef std::function<void(unsigned)> Job;
+
+public:
+  //! \param thread_count Number of workers. Zero is treated as one.
+  explicit WorkerPool(unsigned thread_count)
+  {
+    if (thread_count == 0) {
+      thread_count = 1;
+    }
+    _threads.reserve(thread_count);
+    for (unsigned i = 0; i < thread_count; ++i) {
+      _threads.emplace_back(&WorkerPool::worker_main, this, i);
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  //! \brief Waits for any job in flight, then stops and joins all workers.
+  ~WorkerPool()
+  {
+    wait();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _shutdown = true;
+    }
+    _job_ready.notify_all();
+    for (auto& t : _threads) {
+      t.join();
+    }
+  }
+
+  unsigned size() const { return static_cast<unsigned>(_threads.size()); }
+
+  //! \brief Pins each worker to one CPU the process may run on.
+  //!
+  //! Worker i gets the i-th allowed CPU, wrapping around when there are
+  //! more workers than CPUs. Only supported on Linux.
+  //!
+  //! \return Whether every worker was pinned.
+  bool pin_threads()
+  {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+      return false;
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (cpus.empty()) {
+      return false;
+    }
+    bool pinned = true;
+    for (std::size_t i = 0; i < _threads.size(); ++i) {
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(cpus[i % cpus.size()], &cpu);
+      pinned = pthread_setaffinity_np(_threads[i].native_handle(), sizeof cpu, &cpu) == 0 &&
+               pinned;
+    }
+    return pinned;
+#else
+    return false;
+#endif
+  }
+
+  //! \brief Starts every worker on the given job and returns immediately.
+  //!
+  //! \param job Called once per worker with that worker's index.
+  void submit(Job job)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    assert(_pending == 0);
+    _job = std::move(job);
+    _pending = size();
+    ++_generation;
+    _job_ready.notify_all();
+  }
+
+  //! \brief Blocks calling thread until every worker finished the current job.
+  void wait()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _job_done.wait(lock, [&] { return _pending == 0; });
+  }
+
+  //! \brief Convenience for submit() followed by wait().
+  void run(Job job)
+  {
+    submit(std::move(job));
+    wait();
+  }
+
+private:
+  void worker_main(unsigned index)
+  {
+    unsigned long long seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _job_ready.wait(lock, [&] { return _shutdown || _generation != seen; });
+        if (_shutdown) {
+          return;
+        }
+        seen = _generation;
+      }
+
+      // _job is not modified until every worker has checked in below.
+      _job(index);
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_pending == 0) {
+        _job_done.notify_all();
+      }
+    }
+  }
+
+private:
+  std::vector<std::thread> _threads;
+  Job _job;
+  unsigned _pending = 0;
+  unsigned long long _generation = 0;
+  bool _shutdown = false;
+  std::mutex _mutex;
+  std::condition_variable _job_ready;
+  std::condition_variable _job_done;
+};
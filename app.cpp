@@ -2,65 +2,80 @@
 
 #include <iostream>
 
-MandelbrotApp::MandelbrotApp()
+MandelbrotApp::MandelbrotApp(std::uint32_t width, std::uint32_t height)
   : view_(*this)
+  , engine_(width, height)
+  , compute_thread_(&MandelbrotApp::compute_loop, this)
 {
-  this->initialize(real_center_, imag_center_, real_width_);
+  this->set_focus(width / 2, height / 2);
 }
 
-void MandelbrotApp::process_next_bin()
+std::unique_lock<std::mutex> MandelbrotApp::lock_engine()
+{
+  ++waiting_;
+  std::unique_lock<std::mutex> lock(engine_mutex_);
+  --waiting_;
+  return lock;
+}
+
+template <typename F>
+void MandelbrotApp::change_engine(F change)
 {
-  for (std::pair<int, int> p = *bin_queue_.pop();
-       p != std::pair<int, int>(-1, -1);
-       p = *bin_queue_.pop())
   {
-    bool all_finished = true;
-    unsigned y_start = p.second * bin_width_;
-    unsigned x_start = p.first * bin_width_;
-    for (unsigned y = y_start; y < y_start + bin_width_; ++y) {
-      for (unsigned x = x_start; x < x_start + bin_width_; ++x) {
-        Pixel& px = pixels_[y][x];
-        px.iterate();
-        unsigned char& r = model_.texture_data[model_.window_width*3*y + 3*x + 0];
-        unsigned char& g = model_.texture_data[model_.window_width*3*y + 3*x + 1];
-        unsigned char& b = model_.texture_data[model_.window_width*3*y + 3*x + 2];
-        px.color(r, g, b);
-        if (!px.isFinal()) {
-          all_finished = false;
-        }
-      }
-    }
-    if (all_finished) {
-      bin_finished_[p.second][p.first] = true;
-    }
+    std::unique_lock<std::mutex> lock = lock_engine();
+    change();
+    republish_ = true;
   }
+  engine_changed_.notify_one();
 }
 
-void MandelbrotApp::main_loop()
+MandelbrotApp::~MandelbrotApp()
 {
-  const unsigned thread_count =
-      std::min(std::thread::hardware_concurrency(), max_thread_count_);
-  // TODO: Use a thread pool. This is needlessly expensive.
-  std::vector<std::thread> threads(thread_count);
+  change_engine([this] { stopping_ = true; });
+  compute_thread_.join();
+}
 
-  for (unsigned y = 0; y < model_.window_height / bin_width_; ++y) {
-    for (unsigned x = 0; x < model_.window_width / bin_width_; ++x) {
-      if (!bin_finished_[y][x]) {
-        bin_queue_.push(std::pair<unsigned, unsigned>(x, y));
-      }
+void MandelbrotApp::compute_loop()
+{
+  std::unique_lock<std::mutex> lock(engine_mutex_);
+  for (;;) {
+    // Waiting releases the engine to whoever asked for it.
+    engine_changed_.wait(lock, [this] {
+      return stopping_ || (waiting_ == 0 && (republish_ || !engine_.converged()));
+    });
+    if (stopping_) {
+      return;
     }
+    republish_ = false;
+    if (focus_moved_.exchange(false, std::memory_order_acquire)) {
+      engine_.set_focus(focus_x_.load(std::memory_order_relaxed),
+                        focus_y_.load(std::memory_order_relaxed));
+    }
+    engine_.run_pass(&waiting_);
+    frames_.back().update_from(engine_.frame());
+    stats_.back() = engine_.stats();
+    stats_.publish();
+    frames_.publish();
   }
-  for (unsigned i = 0; i < thread_count; ++i) {
-    bin_queue_.push(std::pair<int, int>(-1, -1));
-  }
+}
 
-  for (unsigned i = 0; i < thread_count; ++i) {
-    threads[i] = std::thread(&MandelbrotApp::process_next_bin, this);
-  }
+MandelbrotEngine::Stats MandelbrotApp::stats() const
+{
+  MandelbrotEngine::Stats stats = stats_.front();
+  stats.upload = view_.upload_time();
+  return stats;
+}
 
-  for (unsigned i = 0; i < thread_count; ++i) {
-    threads[i].join();
-  }
+void MandelbrotApp::resize(std::uint32_t width, std::uint32_t height)
+{
+  change_engine([&] { engine_.resize(width, height); });
+}
+
+void MandelbrotApp::set_focus(int x, int y)
+{
+  focus_x_.store(x, std::memory_order_relaxed);
+  focus_y_.store(y, std::memory_order_relaxed);
+  focus_moved_.store(true, std::memory_order_release);
 }
 
 void MandelbrotApp::update_iterates(int x, int y)
@@ -68,33 +83,61 @@ void MandelbrotApp::update_iterates(int x, int y)
   double new_x;
   double new_y;
 
-  this->get_real_coord_from_screen(new_x, new_y, x, y);
+  {
+    std::unique_lock<std::mutex> lock = lock_engine();
+    engine_.screen_to_complex(new_x, new_y, x, y);
+  }
+  // The compute thread may have stopped to let this call in.
+  engine_changed_.notify_one();
   this->calculate_iterates(new_x, new_y);
 }
 
 void MandelbrotApp::zoom(int x, int y, double factor)
 {
-  double new_x;
-  double new_y;
+  change_engine([&] {
+    engine_.zoom_at(x, y, factor);
+    // The point clicked on is now in the middle.
+    engine_.set_focus(engine_.width() / 2.0, engine_.height() / 2.0);
+    std::cout << "real: " << engine_.real_center_text() << " imag: "
+              << engine_.imag_center_text() << " width: " << engine_.real_width()
+              << (engine_.perturbed() ? " (perturbed)" :
+                  engine_.precision() == LanePrecision::float32 ? " (float)" : "")
+              << std::endl;
+  });
+}
 
-  this->get_real_coord_from_screen(new_x, new_y, x, y);
+void MandelbrotApp::pan(int dx, int dy)
+{
+  change_engine([&] { engine_.pan(dx, dy); });
+}
 
-  double new_width = real_width_ * factor;
-  this->initialize(new_x, new_y, new_width);
-  real_center_ = new_x;
-  imag_center_ = new_y;
-  real_width_ = new_width;
+void MandelbrotApp::cycle_palette()
+{
+  change_engine([&] {
+    // A palette loaded from a file is followed by the first built-in one.
+    const std::vector<Palette>& palettes = Palette::builtins();
+    std::size_t current = 0;
+    while (current < palettes.size() && palettes[current].name() != engine_.palette().name()) {
+      ++current;
+    }
+    engine_.set_palette(palettes[(current + 1) % palettes.size()]);
+    std::cout << "palette: " << engine_.palette().name() << std::endl;
+  });
 }
 
-void MandelbrotApp::get_real_coord_from_screen(double& real_x, double& real_y, double x, double y)
+void MandelbrotApp::set_palette(const Palette& palette)
 {
-  constexpr double window_width = MandelbrotApp::Model::window_width;
-  constexpr double window_height = MandelbrotApp::Model::window_height;
+  change_engine([&] { engine_.set_palette(palette); });
+}
 
-  double screen_x = (double)(x - (window_width / 2)) / ((double)window_width / 2.0);
-  double screen_y = (double)((window_height / 2) - y) / ((double)window_height / 2.0);
-  real_x = screen_x * (real_width_ / 2.0) + real_center_;
-  real_y = screen_y * (real_width_ / 2.0) + imag_center_;
+void MandelbrotApp::set_tile_cache(const std::string& directory)
+{
+  change_engine([&] { engine_.set_tile_cache(directory); });
+}
+
+void MandelbrotApp::set_mixed_precision(bool enabled)
+{
+  change_engine([&] { engine_.set_mixed_precision(enabled); });
 }
 
 void MandelbrotApp::calculate_iterates(double x, double y)
@@ -146,25 +189,3 @@ void MandelbrotApp::calculate_iterates(double x, double y)
   std::cout << "Bounding box: " << "(" << min_real << ", " << min_imag << ")-("
     << max_real << ", " << max_imag << ")" << std::endl;
 }
-
-void MandelbrotApp::initialize(double real_center, double imag_center, double width)
-{
-  std::cout << "real: " << real_center << " imag: "
-            << imag_center << " width: " << width << std::endl;
-
-  double real_start = real_center - width / 2.0;
-  double real;
-  double imag = imag_center + width / 2.0;
-  double real_inc = width / static_cast<double>(model_.window_width);
-  double imag_inc = width / static_cast<double>(model_.window_height);
-
-  unsigned x, y;
-  for (y = 0; y < model_.window_height; ++y, imag -= imag_inc) {
-    for (real = real_start, x = 0; x < model_.window_width; ++x,real += real_inc) {
-      if (y % bin_width_ == 0 && x % bin_width_ == 0) {
-        bin_finished_[y / bin_width_][x / bin_width_] = false;
-      }
-      new (&pixels_[y][x]) Pixel(real, imag, real_inc);
-    }
-  }
-}
@@ -1,7 +1,14 @@
 #pragma once
 #include "view.h"
 #include "mandelbrot.h"
-#include "BlockingQueue.h"
+#include "engine.h"
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
 
 // Given the size of object instances, I recommend heap allocation
 // for this type.
@@ -18,48 +25,89 @@ public:
   };
 
   struct Model {
-    static constexpr std::uint32_t window_width = 800;
-    static constexpr std::uint32_t window_height = 800;
+    static constexpr std::uint32_t default_window_width = 800;
+    static constexpr std::uint32_t default_window_height = 800;
     IterateWindowData iterate_window_data;
     ComplexIterate iterates[IterateWindowData::iterate_limit];
-    static constexpr std::size_t color_channels = 3;
-    std::uint8_t texture_data[window_width * window_height * color_channels];
   };
 
 public: // ***INTERFACE***
-  // This should initialize the view and control.
-  MandelbrotApp();
-  void main_loop();
+  // This should initialize the view and control. Computing starts right
+  // away on a background thread and runs until the view converges, and
+  // again after every change to it.
+  MandelbrotApp(std::uint32_t width = Model::default_window_width,
+                std::uint32_t height = Model::default_window_height);
+  ~MandelbrotApp();
   void update_iterates(int x, int y);
   void zoom(int x, int y, double factor);
+  // Moves the view by whole pixels, keeping what is already rendered.
+  void pan(int dx, int dy);
+  // Switches to the next built-in palette; nothing is iterated again.
+  void cycle_palette();
+  void set_palette(const Palette& palette);
+  void set_tile_cache(const std::string& directory);
+  // See MandelbrotEngine::set_mixed_precision(); off by default.
+  void set_mixed_precision(bool enabled);
+  // Changes the resolution, keeping the view centre and real width. Does
+  // nothing if the size is unchanged.
+  void resize(std::uint32_t width, std::uint32_t height);
+  // Has the part of the frame around this position, such as the cursor,
+  // resolve first. Never waits for the compute thread; the focus moves
+  // before its next pass.
+  void set_focus(int x, int y);
+
+  // True when a frame newer than frame() is waiting. Safe to poll from any
+  // one thread, the one that calls update_frame().
+  bool frame_ready() const { return frames_.fresh(); }
+  // Makes the newest finished frame current, with the engine stats taken
+  // when it was finished. Returns whether it changed.
+  bool update_frame()
+  {
+    stats_.update();
+    return frames_.update();
+  }
+  // The current frame. Only the compute thread writes frames, never this
+  // one, so it can be read without locking.
+  const MandelbrotEngine::Frame& frame() const { return frames_.front(); }
+  // The engine's stats as of the last update_frame(), with the view's
+  // upload time. Same threading as frame().
+  MandelbrotEngine::Stats stats() const;
 
   const Model& model() const { return model_; }
   MandelbrotView& view() { return view_; }
 
 private: // Helper methods
-  // Sets up Pixels according to new bounds. Should be called whenever the extents change.
-  void initialize(double real_center, double imag_center, double width);
   void calculate_iterates(double x, double y);
-  void get_real_coord_from_screen(double& real_x, double& real_y, double x, double y);
-  void process_next_bin();
+  // Runs passes and publishes their frames while the view is live.
+  void compute_loop();
+  // Takes the engine from the compute thread between two passes.
+  std::unique_lock<std::mutex> lock_engine();
+  // Runs change with the engine locked, then has the compute thread carry
+  // on from the changed state.
+  template <typename F>
+  void change_engine(F change);
 
 private:
   MandelbrotView view_;
   Model model_;
+  MandelbrotEngine engine_;
 
-  double real_center_ = -0.85;
-  double imag_center_ = 0.0;
-  double real_width_ = 2.8;
-
-  static constexpr unsigned bin_width_ = 4;
-
-  bool bin_finished_[Model::window_height / bin_width_][Model::window_width / bin_width_];
-
-  Pixel pixels_[Model::window_height][Model::window_width];
-
-  static constexpr unsigned num_bins_ =
-    (Model::window_height / bin_width_) * (Model::window_width / bin_width_);
-
-  static constexpr unsigned max_thread_count_ = 128;
-  BlockingQueue<std::pair<int, int>, num_bins_ + max_thread_count_> bin_queue_;
+  // Guards engine_. The compute thread holds it during every pass. Passes
+  // stop early as soon as waiting_ says another thread wants it, so input
+  // never waits for more than the bins in flight.
+  std::mutex engine_mutex_;
+  std::condition_variable engine_changed_;
+  std::atomic<unsigned> waiting_{0};
+  // Set by every change, since the frame may need publishing even though
+  // the view is converged, such as after a palette change.
+  bool republish_ = true;
+  bool stopping_ = false;
+  std::atomic<int> focus_x_{0};
+  std::atomic<int> focus_y_{0};
+  std::atomic<bool> focus_moved_{false};
+  // Filled from the engine's frame after every pass, a tile at a time.
+  TripleBuffer<MandelbrotEngine::Frame> frames_;
+  TripleBuffer<MandelbrotEngine::Stats> stats_;
+  // Declared last so it starts once everything it touches exists.
+  std::thread compute_thread_;
 };
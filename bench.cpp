@@ -0,0 +1,302 @@
+// Benchmark: renders a fixed set of scenes headlessly and reports throughput
+// as JSON or CSV so results can be compared across commits.
+#include "engine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef MANDEL_COMMIT
+#define MANDEL_COMMIT "unknown"
+#endif
+
+namespace {
+struct Scene {
+  const char* name;
+  double real_center;
+  double imag_center;
+  double width;
+  std::uint64_t iteration_cap;
+};
+
+// Fixed forever; changing a scene makes old results incomparable.
+const Scene scenes[] = {
+  { "default", -0.85, 0.0, 2.8, 20000 },
+  { "seahorse", -0.7453, 0.1127, 0.0006, 20000 },
+  { "interior", -0.3, 0.0, 0.9, 20000 },
+  { "minibrot", -1.7687835984237685, -0.053342552907174164, 0.000003, 50000 },
+};
+
+// Deep views on which skipping iterations by series approximation must give
+// the counts of iterating every pixel in full (see check_series()).
+struct DeepView {
+  const char* real_center;
+  const char* imag_center;
+  double width;
+};
+
+const DeepView deep_views[] = {
+  { "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139", 1e-10 },
+  { "-0.743643887037158704752191506114774", "0.131825904205311970493132056385139", 1e-25 },
+  // The reference escapes before most pixels do.
+  { "-0.7453", "0.1127", 1e-14 },
+};
+
+struct Result {
+  const Scene* scene;
+  double seconds;
+  MandelbrotEngine::Stats stats;
+};
+
+void usage(const char* program)
+{
+  std::cerr
+    << "usage: " << program << " [options]\n"
+    << "Renders each benchmark scene to convergence and reports throughput.\n"
+    << "  --size WxH         image size in pixels (default 400x400)\n"
+    << "  --threads N        worker threads (default: one per hardware thread)\n"
+    << "  --scene NAME       run only this scene (default, seahorse, interior, minibrot)\n"
+    << "  --format F         json or csv (default json)\n"
+    << "  --isa I            scalar, avx2 or avx512 (default: best supported)\n"
+    << "  --region-fill B    on or off (default on)\n"
+    << "  --precision P      auto or double (default double)\n"
+    << "  --bin-width N      4 or 8 (default 4)\n"
+    << "  --pin B            on or off: pin workers to CPUs (default off)\n"
+    << "  --check-series     instead, check that deep views render the same with and\n"
+    << "                     without the series approximation\n";
+}
+
+double seconds(std::chrono::steady_clock::duration d)
+{
+  return std::chrono::duration<double>(d).count();
+}
+
+// Renders each deep view with and without the series approximation and
+// compares the counts. Deep views have pixels whose counts hinge on rounding,
+// so a few may differ either way; more than 1% means the approximation is
+// wrong. Returns whether every view passed.
+bool check_series(unsigned threads)
+{
+  const std::uint32_t width = 200, height = 150;
+  MandelbrotEngine engine(width, height, threads);
+  engine.set_frame_time_target(std::chrono::milliseconds(250));
+  engine.set_iteration_cap(20000);
+  engine.set_samples(1);
+  // Filled regions would hide differences inside them.
+  engine.set_region_fill(false);
+
+  bool passed = true;
+  std::vector<float> counts[2];
+  for (const DeepView& view : deep_views) {
+    for (int series = 0; series < 2; ++series) {
+      engine.set_series_approximation(series == 1);
+      engine.set_view(view.real_center, view.imag_center, view.width);
+      while (!engine.converged()) {
+        engine.run_pass();
+      }
+      counts[series].resize(std::size_t(width) * height);
+      engine.read_counts(0, 0, width, height, counts[series].data());
+    }
+
+    std::size_t differ = 0;
+    for (std::size_t i = 0; i < counts[0].size(); ++i) {
+      const float full = counts[0][i], skipped = counts[1][i];
+      // Interior pixels have no count.
+      if (std::isnan(full) != std::isnan(skipped) || std::abs(full - skipped) > 1.0f) {
+        ++differ;
+      }
+    }
+    const bool ok = differ * 100 <= counts[0].size();
+    std::cout << (ok ? "ok  " : "FAIL") << "  width " << view.width << " at "
+              << view.real_center << ',' << view.imag_center << ": " << differ << " of "
+              << counts[0].size() << " pixels differ by more than one iteration" << std::endl;
+    passed = passed && ok;
+  }
+  return passed;
+}
+
+void write_json(std::ostream& out, const std::vector<Result>& results,
+                std::uint32_t width, std::uint32_t height, unsigned threads)
+{
+  out << "{\n  \"commit\": \"" << MANDEL_COMMIT << "\",\n"
+      << "  \"kernel\": \"" << kernel_isa_name(kernel_isa()) << "\",\n"
+      << "  \"threads\": " << threads << ",\n"
+      << "  \"width\": " << width << ",\n  \"height\": " << height << ",\n"
+      << "  \"scenes\": [";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    const double wall = seconds(r.stats.elapsed);
+    out << (i ? ",\n" : "\n")
+        << "    {\"name\": \"" << r.scene->name << "\""
+        << ", \"iteration_cap\": " << r.scene->iteration_cap
+        << ", \"seconds_to_converge\": " << r.seconds
+        << ", \"passes\": " << r.stats.passes
+        << ", \"iterations\": " << r.stats.iterations()
+        << ", \"iterations_per_sec\": " << r.stats.iterations() / r.seconds
+        << ", \"pixels_finalized\": " << r.stats.pixels_finalized()
+        << ", \"pixels_finalized_per_sec\": " << r.stats.pixels_finalized() / r.seconds
+        << ", \"thread_utilization\": [";
+    for (std::size_t t = 0; t < r.stats.workers.size(); ++t) {
+      out << (t ? ", " : "") << seconds(r.stats.workers[t].busy) / wall;
+    }
+    out << "]}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+void write_csv(std::ostream& out, const std::vector<Result>& results,
+               std::uint32_t width, std::uint32_t height, unsigned threads)
+{
+  out << "commit,kernel,threads,width,height,scene,iteration_cap,seconds_to_converge,passes,"
+         "iterations,iterations_per_sec,pixels_finalized,pixels_finalized_per_sec,"
+         "utilization_mean,utilization_min,utilization_max\n";
+  for (const Result& r : results) {
+    const double wall = seconds(r.stats.elapsed);
+    double sum = 0.0, lo = 1.0, hi = 0.0;
+    for (const MandelbrotEngine::WorkerStats& w : r.stats.workers) {
+      const double u = seconds(w.busy) / wall;
+      sum += u;
+      lo = std::min(lo, u);
+      hi = std::max(hi, u);
+    }
+    out << MANDEL_COMMIT << ',' << kernel_isa_name(kernel_isa()) << ',' << threads << ','
+        << width << ',' << height << ',' << r.scene->name << ',' << r.scene->iteration_cap << ','
+        << r.seconds << ',' << r.stats.passes << ','
+        << r.stats.iterations() << ',' << r.stats.iterations() / r.seconds << ','
+        << r.stats.pixels_finalized() << ',' << r.stats.pixels_finalized() / r.seconds << ','
+        << sum / r.stats.workers.size() << ',' << lo << ',' << hi << '\n';
+  }
+}
+}
+
+int main(int argc, char* argv[])
+{
+  std::uint32_t width = 400, height = 400;
+  unsigned threads = 0;
+  std::string only;
+  std::string format = "json";
+  bool region_fill = true;
+  bool mixed_precision = false;
+  unsigned bin_width = 4;
+  bool pin = false;
+  bool series_check = false;
+
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (std::strcmp(arg, "--check-series") == 0) {
+      series_check = true;
+      continue;
+    }
+    const char* value = i + 1 < argc ? argv[++i] : nullptr;
+    char* end = nullptr;
+    if (!value) {
+      usage(argv[0]);
+      return 1;
+    } else if (std::strcmp(arg, "--size") == 0) {
+      width = std::strtoul(value, &end, 10);
+      height = *end == 'x' ? std::strtoul(end + 1, &end, 10) : 0;
+      if (*end != '\0' || width == 0 || height == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(arg, "--threads") == 0) {
+      threads = std::strtoul(value, &end, 10);
+      if (end == value || *end != '\0') {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(arg, "--scene") == 0) {
+      only = value;
+    } else if (std::strcmp(arg, "--format") == 0 &&
+               (std::strcmp(value, "json") == 0 || std::strcmp(value, "csv") == 0)) {
+      format = value;
+    } else if (std::strcmp(arg, "--isa") == 0) {
+      KernelIsa isa;
+      if (std::strcmp(value, "avx512") == 0) {
+        isa = KernelIsa::avx512;
+      } else if (std::strcmp(value, "avx2") == 0) {
+        isa = KernelIsa::avx2;
+      } else if (std::strcmp(value, "scalar") == 0) {
+        isa = KernelIsa::scalar;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      // set_kernel_isa() falls back rather than fail, which would measure
+      // some other kernel than the one asked for.
+      set_kernel_isa(isa);
+      if (kernel_isa() != isa) {
+        std::cerr << argv[0] << ": this CPU does not support " << value << std::endl;
+        return 1;
+      }
+    } else if (std::strcmp(arg, "--region-fill") == 0 &&
+               (std::strcmp(value, "on") == 0 || std::strcmp(value, "off") == 0)) {
+      region_fill = std::strcmp(value, "on") == 0;
+    } else if (std::strcmp(arg, "--precision") == 0 &&
+               (std::strcmp(value, "auto") == 0 || std::strcmp(value, "double") == 0)) {
+      mixed_precision = std::strcmp(value, "auto") == 0;
+    } else if (std::strcmp(arg, "--bin-width") == 0) {
+      bin_width = std::strtoul(value, &end, 10);
+      if (end == value || *end != '\0') {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (std::strcmp(arg, "--pin") == 0 &&
+               (std::strcmp(value, "on") == 0 || std::strcmp(value, "off") == 0)) {
+      pin = std::strcmp(value, "on") == 0;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (series_check) {
+    return check_series(threads) ? 0 : 1;
+  }
+
+  MandelbrotEngine engine(width, height, threads);
+  // Long passes keep scheduling overhead out of the measurement.
+  engine.set_frame_time_target(std::chrono::milliseconds(250));
+  engine.set_region_fill(region_fill);
+  engine.set_mixed_precision(mixed_precision);
+  if (!engine.set_bin_width(bin_width)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (pin && !engine.pin_threads()) {
+    std::cerr << argv[0] << ": could not pin every worker thread" << std::endl;
+  }
+
+  std::vector<Result> results;
+  for (const Scene& scene : scenes) {
+    if (!only.empty() && only != scene.name) {
+      continue;
+    }
+    engine.set_iteration_cap(scene.iteration_cap);
+    engine.set_view(scene.real_center, scene.imag_center, scene.width);
+    engine.reset_stats();
+
+    const auto start = std::chrono::steady_clock::now();
+    while (!engine.converged()) {
+      engine.run_pass();
+    }
+    results.push_back(Result{ &scene, seconds(std::chrono::steady_clock::now() - start),
+                              engine.stats() });
+  }
+
+  if (results.empty()) {
+    std::cerr << argv[0] << ": no scene named " << only << std::endl;
+    return 1;
+  }
+
+  if (format == "csv") {
+    write_csv(std::cout, results, width, height, engine.thread_count());
+  } else {
+    write_json(std::cout, results, width, height, engine.thread_count());
+  }
+  return 0;
+}
@@ -0,0 +1,1096 @@
+#include "engine.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <sstream>
+
+// std::min binds references to these, so they need definitions of their own
+// wherever the call is not inlined.
+constexpr std::uint64_t MandelbrotEngine::max_series_skip_;
+constexpr unsigned MandelbrotEngine::max_thread_count_;
+
+MandelbrotEngine::MandelbrotEngine(std::uint32_t width, std::uint32_t height,
+                                   unsigned thread_count)
+  : workers_(std::min(thread_count ? thread_count : std::thread::hardware_concurrency(),
+                      max_thread_count_))
+{
+  worker_stats_.resize(workers_.size());
+  queues_ = std::vector<WorkerQueue>(workers_.size());
+  ScreenPixel::samplePositions(sample_x_, sample_y_);
+  reference_.set_point(-0.85, 0.0);
+  this->allocate(width, height);
+  this->initialize();
+}
+
+void MandelbrotEngine::set_view(double real_center, double imag_center, double width)
+{
+  reference_.set_point(real_center, imag_center);
+  real_width_ = width;
+  this->initialize();
+}
+
+bool MandelbrotEngine::set_view(const std::string& real_center, const std::string& imag_center,
+                                double width, double real_offset, double imag_offset)
+{
+  ensure_precision(width);
+  if (!reference_.set_point(real_center, imag_center)) {
+    return false;
+  }
+  if (real_offset != 0.0 || imag_offset != 0.0) {
+    reference_.offset_point(real_offset, imag_offset);
+  }
+  real_width_ = width;
+  this->initialize();
+  return true;
+}
+
+void MandelbrotEngine::zoom_at(double x, double y, double factor)
+{
+  // The offset is small next to the centre, so a double carries it exactly
+  // enough; only the sum needs more.
+  const double pixel_width = real_width_ / frame_.width;
+  const double real_offset = (x - frame_.width / 2.0) * pixel_width;
+  const double imag_offset = (frame_.height / 2.0 - y) * pixel_width;
+  this->keep_previous();
+  real_width_ *= factor;
+  ensure_precision(real_width_);
+  reference_.offset_point(real_offset, imag_offset);
+  this->initialize();
+  this->reuse_previous(x - frame_.width / 2.0, y - frame_.height / 2.0, factor);
+}
+
+void MandelbrotEngine::pan(int dx, int dy)
+{
+  const double pixel_width = real_width_ / frame_.width;
+  this->keep_previous();
+  reference_.offset_point(dx * pixel_width, -dy * pixel_width);
+  this->initialize();
+  this->reuse_previous(dx, dy, 1.0);
+}
+
+void MandelbrotEngine::ensure_precision(double width)
+{
+  // Enough bits to resolve a sub-sample position, plus a margin for the
+  // magnitude of the centre and for rounding along the reference orbit.
+  const double pixel_width = width / std::max(frame_.width, 1u);
+  const unsigned bits = 64 + static_cast<unsigned>(std::max(0.0, -std::log2(pixel_width)));
+  if (bits > reference_.precision()) {
+    reference_.set_precision(bits);
+  }
+}
+
+void MandelbrotEngine::resize(std::uint32_t width, std::uint32_t height)
+{
+  if (width == frame_.width && height == frame_.height) {
+    return;
+  }
+  this->allocate(width, height);
+  this->initialize();
+}
+
+void MandelbrotEngine::allocate(std::uint32_t width, std::uint32_t height)
+{
+  frame_.width = width;
+  frame_.height = height;
+  frame_.texture_data.resize(std::size_t(width) * height * Frame::color_channels);
+
+  bins_wide_ = (width + bin_width_ - 1) / bin_width_;
+  bins_high_ = (height + bin_width_ - 1) / bin_width_;
+  bin_finished_.resize(std::size_t(bins_wide_) * bins_high_);
+  bins_.resize(bin_finished_.size(), offsetof(Bin, pixels) + bin_pixels_ * sizeof(ScreenPixel));
+  live_bins_list_.reserve(bin_finished_.size());
+  bin_phase_.resize(bin_finished_.size());
+  bin_ring_.resize(bin_finished_.size());
+  sample_counts_.resize(std::size_t(width) * height * samples_);
+  bin_dirty_.resize(bin_finished_.size());
+  dirty_bins_list_.reserve(bin_finished_.size());
+
+  tiles_wide_ = (width + tile_width_ - 1) / tile_width_;
+  tiles_high_ = (height + tile_width_ - 1) / tile_width_;
+  tile_done_.resize(std::size_t(tiles_wide_) * tiles_high_);
+  frame_.tile_versions.resize(tile_done_.size());
+}
+
+void MandelbrotEngine::set_samples(unsigned samples)
+{
+  const unsigned most = ScreenPixel::subsamples;
+  samples_ = std::min(std::max(samples, 1u), most);
+  sample_counts_.resize(std::size_t(frame_.width) * frame_.height * samples_);
+  this->initialize();
+}
+
+void MandelbrotEngine::set_refine_threshold(double iterations)
+{
+  refine_threshold_ = iterations;
+  this->initialize();
+}
+
+void MandelbrotEngine::set_tile_cache(const std::string& directory)
+{
+  if (directory.empty()) {
+    tile_cache_.reset();
+  } else {
+    tile_cache_.reset(new TileCache(directory));
+  }
+  this->initialize();
+}
+
+void MandelbrotEngine::set_mixed_precision(bool enabled)
+{
+  mixed_precision_ = enabled;
+  this->initialize();
+}
+
+void MandelbrotEngine::set_region_fill(bool enabled)
+{
+  region_fill_ = enabled;
+  this->initialize();
+}
+
+void MandelbrotEngine::set_series_approximation(bool enabled)
+{
+  series_enabled_ = enabled;
+  this->initialize();
+}
+
+bool MandelbrotEngine::bin_width_supported(unsigned width)
+{
+  return width != 0 && width <= max_bin_width_ && tile_width_ % width == 0 &&
+         width * width % IterateLanes::width == 0;
+}
+
+bool MandelbrotEngine::set_bin_width(unsigned width)
+{
+  if (!bin_width_supported(width)) {
+    return false;
+  }
+  bin_width_ = width;
+  bin_pixels_ = width * width;
+  all_pixels_ = bin_pixels_ == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << bin_pixels_) - 1;
+  this->allocate(frame_.width, frame_.height);
+  this->initialize();
+  return true;
+}
+
+bool MandelbrotEngine::pin_threads()
+{
+  const bool pinned = workers_.pin_threads();
+  // Pages stay on the node of the core that first touched them, so every
+  // bin is handed back and touched again by its pinned owner.
+  for (std::size_t bin_index = 0; bin_index < bins_.size(); ++bin_index) {
+    bins_.release(bin_index);
+  }
+  this->initialize();
+  return pinned;
+}
+
+std::size_t MandelbrotEngine::bin_tile(std::size_t bin_index) const
+{
+  const unsigned tile_bins = tile_width_ / bin_width_;
+  return bin_index / bins_wide_ / tile_bins * tiles_wide_ + bin_index % bins_wide_ / tile_bins;
+}
+
+unsigned MandelbrotEngine::bin_owner(std::size_t bin_index) const
+{
+  return bin_tile(bin_index) % queues_.size();
+}
+
+void MandelbrotEngine::compact_live_bins()
+{
+  live_bins_list_.erase(
+      std::remove_if(live_bins_list_.begin(), live_bins_list_.end(),
+                     [this](std::uint32_t bin) { return bin_finished_[bin]; }),
+      live_bins_list_.end());
+}
+
+void MandelbrotEngine::process_next_bin(unsigned worker, const std::atomic<unsigned>* stop)
+{
+  WorkerStats& stats = worker_stats_[worker].stats;
+  const auto start = std::chrono::steady_clock::now();
+
+  // Own queue first, then the others' in turn once it runs dry.
+  for (unsigned k = 0; k < queues_.size(); ) {
+    // Checking before every claim keeps the bins claimed a prefix of each
+    // queue, so run_pass knows exactly which were skipped.
+    if (stop && stop->load(std::memory_order_relaxed)) {
+      break;
+    }
+    WorkerQueue& queue = queues_[(worker + k) % queues_.size()];
+    const std::size_t i = queue.next.fetch_add(1, std::memory_order_relaxed);
+    if (i >= queue.bins.size()) {
+      ++k;
+      continue;
+    }
+    const std::size_t bin_index = queue.bins[i];
+    Bin& bin = bins_[bin_index];
+    BinPhase& phase = bin_phase_[bin_index];
+
+    bool changed = false;
+    if (phase == refine_ready) {
+      changed = start_refinement(bin_index, stats);
+      phase = refining;
+    }
+    // Bins away from the focus run a smaller share of the pass and fall
+    // behind by the rest.
+    const unsigned share = std::max(pass_budget_ >> bin_ring_[bin_index], 1u);
+    unsigned budget = share;
+    if (iteration_cap_) {
+      budget = static_cast<unsigned>(
+          std::min<std::uint64_t>(budget, iteration_cap_ - (iterations_run_ - bin.start)));
+    }
+    const bool capped = iteration_cap_ && iterations_run_ - bin.start + budget >= iteration_cap_;
+    bin.start += pass_budget_ - share;
+
+    if (phase == centres) {
+      changed = iterate_centres(bin_index, budget, stats) || changed;
+      bool done = true;
+      for (unsigned group = 0; group < bin_pixels_ / IterateLanes::width; ++group) {
+        done = done && bin.centres[group].finished();
+      }
+      if (done || capped) {
+        phase = centres_done;
+      }
+    } else {
+      changed = iterate_refined(bin_index, budget, stats) || changed;
+      if (bin.live == 0 || capped) {
+        finish_bin(bin_index);
+      }
+    }
+    if (changed) {
+      bin_dirty_[bin_index] = true;
+    }
+    ++stats.bins;
+  }
+
+  stats.busy += std::chrono::steady_clock::now() - start;
+}
+
+bool MandelbrotEngine::iterate_centres(std::size_t bin_index, unsigned budget, WorkerStats& stats)
+{
+  Bin& bin = bins_[bin_index];
+  const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+  const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+
+  bool changed = false;
+  for (unsigned group = 0; group < bin_pixels_ / IterateLanes::width; ++group) {
+    IterateLanes& lanes = bin.centres[group];
+    if (lanes.finished()) {
+      continue;
+    }
+    const std::uint8_t escaped = lanes.escaped_bits;
+    stats.iterations += perturbed_ ? iterate_lanes(lanes, budget, reference_)
+                                   : iterate_lanes(lanes, budget, precision_);
+    // Until it is refined, a pixel is drawn from its centre alone.
+    for (unsigned lane = 0; lane < IterateLanes::width; ++lane) {
+      if ((lanes.escaped_bits & ~escaped) >> lane & 1) {
+        const unsigned offset = group * IterateLanes::width + lane;
+        const std::size_t pixel = std::size_t(y_start + offset / bin_width_) * frame_.width +
+                                  x_start + offset % bin_width_;
+        std::fill_n(&sample_counts_[pixel * samples_], samples_, lanes.count(lane));
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+bool MandelbrotEngine::start_refinement(std::size_t bin_index, WorkerStats& stats)
+{
+  Bin& bin = bins_[bin_index];
+  const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+  const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+  // The pixels start where the centres did.
+  bin.start = iterations_run_ - (perturbed_ ? series_.skipped() : 0);
+  bin.live = 0;
+
+  bool changed = false;
+  for (unsigned offset = 0; offset < bin_pixels_; ++offset) {
+    if (bin.fixed >> offset & 1) {
+      continue;
+    }
+    const unsigned y = y_start + offset / bin_width_;
+    const unsigned x = x_start + offset % bin_width_;
+    const float centre = sample_counts_[(std::size_t(y) * frame_.width + x) * samples_];
+    bool refine = false;
+    for (unsigned ny = y ? y - 1 : y; !refine && ny <= y + 1 && ny < frame_.height; ++ny) {
+      for (unsigned nx = x ? x - 1 : x; nx <= x + 1 && nx < frame_.width; ++nx) {
+        const float neighbour = sample_counts_[(std::size_t(ny) * frame_.width + nx) * samples_];
+        refine = refine || std::isnan(neighbour) != std::isnan(centre) ||
+                 std::abs(neighbour - centre) > refine_threshold_;
+      }
+    }
+    if (!refine || samples_ == 1) {
+      ++stats.pixels_finalized;
+      continue;
+    }
+
+    ScreenPixel& px = bin.pixels[offset];
+    new (&px) ScreenPixel(pixel_left(x), pixel_top(y), real_inc_,
+                          perturbed_ ? &series_ : nullptr, 1, samples_);
+    // Sub-samples the analytic test settles are done before any iteration.
+    px.sampleCounts(&sample_counts_[(std::size_t(y) * frame_.width + x) * samples_]);
+    bin.live |= std::uint64_t(1) << offset;
+    changed = true;
+  }
+  return changed;
+}
+
+bool MandelbrotEngine::iterate_refined(std::size_t bin_index, unsigned budget, WorkerStats& stats)
+{
+  Bin& bin = bins_[bin_index];
+  const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+  const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+
+  bool changed = false;
+  for (unsigned offset = 0; offset < bin_pixels_; ++offset) {
+    if (!(bin.live >> offset & 1)) {
+      continue;
+    }
+    const unsigned y = y_start + offset / bin_width_;
+    const unsigned x = x_start + offset % bin_width_;
+    ScreenPixel& px = bin.pixels[offset];
+    const unsigned finished = px.finishedSamples();
+    stats.iterations += px.iterate(budget, perturbed_ ? &reference_ : nullptr, precision_);
+    // Most passes leave most pixels looking the same; only sub-samples that
+    // just finished need their counts written and their colour redone.
+    if (px.finishedSamples() != finished) {
+      px.sampleCounts(&sample_counts_[(std::size_t(y) * frame_.width + x) * samples_]);
+      changed = true;
+    }
+    if (px.isFinal()) {
+      bin.live &= ~(std::uint64_t(1) << offset);
+      ++stats.pixels_finalized;
+    }
+  }
+  return changed;
+}
+
+void MandelbrotEngine::release_waiting_bins()
+{
+  // Only runs between passes, so neighbours' phases are stable.
+  for (const std::uint32_t bin_index : live_bins_list_) {
+    if (bin_finished_[bin_index] || bin_phase_[bin_index] != centres_done) {
+      continue;
+    }
+    const unsigned bin_y = bin_index / bins_wide_;
+    const unsigned bin_x = bin_index % bins_wide_;
+    bool ready = true;
+    for (unsigned ny = bin_y ? bin_y - 1 : bin_y; ready && ny <= bin_y + 1 && ny < bins_high_; ++ny) {
+      for (unsigned nx = bin_x ? bin_x - 1 : bin_x; nx <= bin_x + 1 && nx < bins_wide_; ++nx) {
+        const std::size_t neighbour = std::size_t(ny) * bins_wide_ + nx;
+        ready = ready && (bin_finished_[neighbour] ||
+                          (bin_phase_[neighbour] != centres && bin_phase_[neighbour] != held));
+      }
+    }
+    if (ready) {
+      bin_phase_[bin_index] = refine_ready;
+    }
+  }
+}
+
+void MandelbrotEngine::start_regions()
+{
+  regions_.clear();
+  if (!region_fill_) {
+    return;
+  }
+  const unsigned tile_bins = tile_width_ / bin_width_;
+  for (unsigned top = 0; top < bins_high_; top += tile_bins) {
+    for (unsigned left = 0; left < bins_wide_; left += tile_bins) {
+      const Region region{ left, top, std::min(left + tile_bins, bins_wide_) - 1,
+                           std::min(top + tile_bins, bins_high_) - 1, iterations_run_ };
+      if (region.right - region.left < 2 || region.bottom - region.top < 2) {
+        continue;
+      }
+      for (unsigned y = region.top + 1; y < region.bottom; ++y) {
+        for (unsigned x = region.left + 1; x < region.right; ++x) {
+          bin_phase_[std::size_t(y) * bins_wide_ + x] = held;
+        }
+      }
+      regions_.push_back(region);
+    }
+  }
+}
+
+void MandelbrotEngine::release_held_bin(std::size_t bin_index)
+{
+  if (bin_finished_[bin_index] || bin_phase_[bin_index] != held) {
+    return;
+  }
+  bin_phase_[bin_index] = centres;
+  bins_[bin_index].start = iterations_run_ - (perturbed_ ? series_.skipped() : 0);
+}
+
+void MandelbrotEngine::resolve_regions()
+{
+  // Only runs between passes, so the border counts are stable.
+  split_regions_.clear();
+  for (const Region& region : regions_) {
+    const unsigned x_start = region.left * bin_width_;
+    const unsigned y_start = region.top * bin_width_;
+    const unsigned x_end = std::min((region.right + 1) * bin_width_, frame_.width) - 1;
+    const unsigned y_end = std::min((region.bottom + 1) * bin_width_, frame_.height) - 1;
+
+    bool escaped = false;
+    bool decided = true;
+    auto check = [&](unsigned x, unsigned y) {
+      // Escaped centres have a count from the moment they escape.
+      escaped = escaped ||
+                !std::isnan(sample_counts_[(std::size_t(y) * frame_.width + x) * samples_]);
+      const std::size_t bin_index = std::size_t(y / bin_width_) * bins_wide_ + x / bin_width_;
+      decided = decided && (bin_finished_[bin_index] || bin_phase_[bin_index] != centres);
+    };
+    for (unsigned x = x_start; !escaped && x <= x_end; ++x) {
+      check(x, y_start);
+      check(x, y_end);
+    }
+    for (unsigned y = y_start + 1; !escaped && y < y_end; ++y) {
+      check(x_start, y);
+      check(x_end, y);
+    }
+
+    if (decided && !escaped) {
+      // Every count inside is still the NaN it started as, or was reused
+      // from the previous view.
+      for (unsigned y = region.top + 1; y < region.bottom; ++y) {
+        for (unsigned x = region.left + 1; x < region.right; ++x) {
+          const std::size_t bin_index = std::size_t(y) * bins_wide_ + x;
+          if (!bin_finished_[bin_index]) {
+            stats_pixels_filled_ +=
+                std::bitset<max_bin_pixels_>(all_pixels_ & ~bins_[bin_index].fixed).count();
+            finish_bin(bin_index);
+          }
+        }
+      }
+    } else if (escaped || iterations_run_ - region.start >= region_wait_) {
+      // Split across the longer side; halves too thin to hold anything are
+      // all border.
+      Region first = region;
+      Region second = region;
+      first.start = second.start = iterations_run_;
+      if (region.right - region.left >= region.bottom - region.top) {
+        const unsigned middle = (region.left + region.right) / 2;
+        for (unsigned y = region.top + 1; y < region.bottom; ++y) {
+          release_held_bin(std::size_t(y) * bins_wide_ + middle);
+        }
+        first.right = second.left = middle;
+      } else {
+        const unsigned middle = (region.top + region.bottom) / 2;
+        for (unsigned x = region.left + 1; x < region.right; ++x) {
+          release_held_bin(std::size_t(middle) * bins_wide_ + x);
+        }
+        first.bottom = second.top = middle;
+      }
+      for (const Region& half : { first, second }) {
+        if (half.right - half.left >= 2 && half.bottom - half.top >= 2) {
+          split_regions_.push_back(half);
+        }
+      }
+    } else {
+      split_regions_.push_back(region);
+    }
+  }
+  regions_.swap(split_regions_);
+}
+
+void MandelbrotEngine::run_pass(const std::atomic<unsigned>* stop)
+{
+  if (converged()) {
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // Bins clamp the budget to their own share of the cap.
+  pass_budget_ = iteration_budget_;
+
+  // A lane's orbit index never exceeds its iteration count plus one, so this
+  // covers every lookup in the pass. Extending it here keeps the cost of the
+  // reference in step with the pixels, and workers only ever read it.
+  if (perturbed_) {
+    reference_.extend(iterations_run_ + pass_budget_ + 2);
+  }
+
+  if (focus_changed_) {
+    prioritize_bins();
+  }
+
+  // Held bins and bins waiting for their neighbours have nothing to do,
+  // and their start is reset before they next run. The pool's submit/wait
+  // handshake orders the queues before the workers' reads of them, so the
+  // claims can be relaxed.
+  for (WorkerQueue& queue : queues_) {
+    queue.bins.clear();
+    queue.next.store(0, std::memory_order_relaxed);
+  }
+  for (const std::uint32_t bin_index : live_bins_list_) {
+    if (bin_phase_[bin_index] != held && bin_phase_[bin_index] != centres_done) {
+      queues_[bin_owner(bin_index)].bins.push_back(bin_index);
+    }
+  }
+  const auto iterate_start = std::chrono::steady_clock::now();
+  workers_.run([this, stop](unsigned worker) { process_next_bin(worker, stop); });
+  const auto iterate = std::chrono::steady_clock::now() - iterate_start;
+  bool stopped = false;
+  for (WorkerQueue& queue : queues_) {
+    for (std::size_t i = queue.next; i < queue.bins.size(); ++i) {
+      bins_[queue.bins[i]].start += pass_budget_;
+      stopped = true;
+    }
+  }
+  iterations_run_ += pass_budget_;
+
+  this->resolve_regions();
+  this->compact_live_bins();
+  this->release_waiting_bins();
+  if (tile_cache_) {
+    store_finished_tiles();
+  }
+
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  ++stats_passes_;
+  stats_iterate_ += iterate;
+  stats_queue_ += elapsed - iterate;
+  // A pass cut short says nothing about how long a full one takes.
+  if (!stopped) {
+    adapt_iteration_budget(elapsed);
+  }
+}
+
+void MandelbrotEngine::set_focus(double x, double y)
+{
+  focused_ = true;
+  focus_x_ = x / frame_.width;
+  focus_y_ = y / frame_.height;
+  focus_changed_ = true;
+}
+
+void MandelbrotEngine::prioritize_bins()
+{
+  focus_changed_ = false;
+  if (!focused_) {
+    return;
+  }
+
+  const double focus_x = focus_x_ * frame_.width;
+  const double focus_y = focus_y_ * frame_.height;
+  const double ring = focus_ring_ * std::max(frame_.width, frame_.height);
+  auto distance_sqr = [&](std::uint32_t bin_index) {
+    const double x = (bin_index % bins_wide_ + 0.5) * bin_width_ - focus_x;
+    const double y = (bin_index / bins_wide_ + 0.5) * bin_width_ - focus_y;
+    return x * x + y * y;
+  };
+  for (const std::uint32_t bin_index : live_bins_list_) {
+    unsigned char r = 0;
+    for (double d = std::sqrt(distance_sqr(bin_index)); d >= ring && r < max_ring_; d /= 2.0) {
+      ++r;
+    }
+    bin_ring_[bin_index] = r;
+  }
+  std::sort(live_bins_list_.begin(), live_bins_list_.end(),
+            [&](std::uint32_t a, std::uint32_t b) { return distance_sqr(a) < distance_sqr(b); });
+}
+
+void MandelbrotEngine::set_palette(const Palette& palette)
+{
+  palette_ = palette;
+  std::fill(bin_dirty_.begin(), bin_dirty_.end(), true);
+}
+
+const MandelbrotEngine::Frame& MandelbrotEngine::frame()
+{
+  this->color_dirty_bins();
+  return frame_;
+}
+
+void MandelbrotEngine::read_counts(std::uint32_t x, std::uint32_t y, std::uint32_t width,
+                                   std::uint32_t height, float* counts) const
+{
+  for (std::uint32_t row = y; row < y + height; ++row) {
+    const float* first = &sample_counts_[(std::size_t(row) * frame_.width + x) * samples_];
+    counts = std::copy(first, first + std::size_t(width) * samples_, counts);
+  }
+}
+
+void MandelbrotEngine::color_dirty_bins()
+{
+  ++frame_version_;
+  dirty_bins_list_.clear();
+  for (std::size_t bin = 0; bin < bin_dirty_.size(); ++bin) {
+    if (bin_dirty_[bin]) {
+      dirty_bins_list_.push_back(static_cast<std::uint32_t>(bin));
+      bin_dirty_[bin] = false;
+      frame_.tile_versions[bin_tile(bin)] = frame_version_;
+    }
+  }
+  if (dirty_bins_list_.empty()) {
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  next_bin_.store(0, std::memory_order_relaxed);
+  workers_.run([this](unsigned) { color_next_bin(); });
+  stats_colour_ += std::chrono::steady_clock::now() - start;
+}
+
+void MandelbrotEngine::color_next_bin()
+{
+  for (std::size_t i = next_bin_.fetch_add(1, std::memory_order_relaxed);
+       i < dirty_bins_list_.size();
+       i = next_bin_.fetch_add(1, std::memory_order_relaxed))
+  {
+    const std::size_t bin_index = dirty_bins_list_[i];
+    const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+    const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+    const unsigned y_end = std::min(y_start + bin_width_, frame_.height);
+    const unsigned x_end = std::min(x_start + bin_width_, frame_.width);
+    for (unsigned y = y_start; y < y_end; ++y) {
+      const std::size_t pixel = std::size_t(y) * frame_.width + x_start;
+      palette_.color(&sample_counts_[pixel * samples_], samples_,
+                     x_end - x_start, &frame_.texture_data[pixel * Frame::color_channels]);
+    }
+  }
+}
+
+void MandelbrotEngine::Frame::update_from(const Frame& source)
+{
+  if (width != source.width || height != source.height) {
+    width = source.width;
+    height = source.height;
+    texture_data.resize(source.texture_data.size());
+    // Versions start at one, so every tile is copied.
+    tile_versions.assign(source.tile_versions.size(), 0);
+  }
+
+  const std::size_t row_bytes = std::size_t(width) * color_channels;
+  for (std::size_t tile = 0; tile < tile_versions.size(); ++tile) {
+    if (tile_versions[tile] == source.tile_versions[tile]) {
+      continue;
+    }
+    const unsigned x_start = tile % tiles_wide() * tile_width;
+    const unsigned y_start = tile / tiles_wide() * tile_width;
+    const std::size_t bytes = (std::min(x_start + tile_width, width) - x_start) * color_channels;
+    for (unsigned y = y_start; y < std::min(y_start + tile_width, height); ++y) {
+      const std::size_t offset = y * row_bytes + x_start * color_channels;
+      std::copy_n(&source.texture_data[offset], bytes, &texture_data[offset]);
+    }
+    tile_versions[tile] = source.tile_versions[tile];
+  }
+}
+
+MandelbrotEngine::Stats MandelbrotEngine::stats() const
+{
+  Stats stats;
+  stats.passes = stats_passes_;
+  stats.elapsed = stats_queue_ + stats_iterate_;
+  stats.queue = stats_queue_;
+  stats.iterate = stats_iterate_;
+  stats.colour = stats_colour_;
+  stats.live_bins = live_bins_;
+  stats.pixels_filled = stats_pixels_filled_;
+  stats.workers.reserve(worker_stats_.size());
+  for (const PaddedWorkerStats& w : worker_stats_) {
+    stats.workers.push_back(w.stats);
+  }
+  return stats;
+}
+
+void MandelbrotEngine::reset_stats()
+{
+  stats_passes_ = 0;
+  stats_queue_ = std::chrono::steady_clock::duration::zero();
+  stats_iterate_ = std::chrono::steady_clock::duration::zero();
+  stats_colour_ = std::chrono::steady_clock::duration::zero();
+  stats_pixels_filled_ = 0;
+  for (PaddedWorkerStats& w : worker_stats_) {
+    w.stats = WorkerStats();
+  }
+}
+
+std::uint64_t MandelbrotEngine::Stats::iterations() const
+{
+  std::uint64_t total = 0;
+  for (const WorkerStats& w : workers) {
+    total += w.iterations;
+  }
+  return total;
+}
+
+std::uint64_t MandelbrotEngine::Stats::pixels_finalized() const
+{
+  std::uint64_t total = pixels_filled;
+  for (const WorkerStats& w : workers) {
+    total += w.pixels_finalized;
+  }
+  return total;
+}
+
+void MandelbrotEngine::Stats::write_json(std::ostream& out) const
+{
+  auto seconds = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  };
+  out << "{\"passes\": " << passes
+      << ", \"iterations\": " << iterations()
+      << ", \"pixels_finalized\": " << pixels_finalized()
+      << ", \"pixels_filled\": " << pixels_filled
+      << ", \"live_bins\": " << live_bins
+      << ", \"queue\": " << seconds(queue)
+      << ", \"iterate\": " << seconds(iterate)
+      << ", \"colour\": " << seconds(colour)
+      << ", \"upload\": " << seconds(upload)
+      << ", \"workers\": [";
+  for (std::size_t t = 0; t < workers.size(); ++t) {
+    const WorkerStats& w = workers[t];
+    out << (t ? ", " : "") << "{\"iterations\": " << w.iterations
+        << ", \"pixels_finalized\": " << w.pixels_finalized
+        << ", \"bins\": " << w.bins
+        << ", \"busy\": " << seconds(w.busy)
+        << ", \"idle\": " << seconds(idle(w)) << '}';
+  }
+  out << "]}\n";
+}
+
+bool MandelbrotEngine::converged() const
+{
+  return live_bins_ == 0;
+}
+
+void MandelbrotEngine::set_iteration_budget(unsigned iterations)
+{
+  iteration_budget_ = std::max(iterations, 1u);
+  frame_time_target_ = std::chrono::microseconds::zero();
+}
+
+void MandelbrotEngine::set_frame_time_target(std::chrono::microseconds target)
+{
+  frame_time_target_ = target;
+}
+
+void MandelbrotEngine::adapt_iteration_budget(std::chrono::steady_clock::duration elapsed)
+{
+  if (frame_time_target_ == std::chrono::microseconds::zero()) {
+    return;
+  }
+
+  // Cap the step in either direction: the cost of a pass changes abruptly as
+  // bins finish, and a single slow frame should not collapse the budget.
+  const double ratio = static_cast<double>(frame_time_target_.count()) /
+      std::max<double>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(), 1.0);
+  const double scaled = iteration_budget_ * std::min(std::max(ratio, 0.5), 2.0);
+  iteration_budget_ = static_cast<unsigned>(
+      std::min(std::max(scaled, 1.0), static_cast<double>(max_iteration_budget_)));
+}
+
+void MandelbrotEngine::screen_to_complex(double& real, double& imag, double x, double y) const
+{
+  const double window_width = frame_.width;
+  const double window_height = frame_.height;
+
+  // Pixels are square, so both axes share the horizontal pixel spacing.
+  const double pixel_width = real_width_ / window_width;
+  real = (x - window_width / 2.0) * pixel_width + reference_.real();
+  imag = (window_height / 2.0 - y) * pixel_width + reference_.imag();
+}
+
+void MandelbrotEngine::initialize()
+{
+  if (frame_time_target_ != std::chrono::microseconds::zero()) {
+    iteration_budget_ = initial_iteration_budget_;
+  }
+  iterations_run_ = 0;
+  real_inc_ = real_width_ / static_cast<double>(frame_.width);
+
+  const double magnitude = std::max({ std::abs(reference_.real()), std::abs(reference_.imag()), 1.0 });
+  perturbed_ = real_inc_ < perturbation_spacing_ * magnitude;
+  precision_ = mixed_precision_ && real_inc_ >= single_spacing_ * magnitude ?
+      LanePrecision::float32 : LanePrecision::float64;
+  if (perturbed_) {
+    ensure_precision(real_width_);
+    reference_.set_periodicity_tolerance(
+        std::min(periodicity_check().tolerance, real_inc_ * 1e-4));
+    // The corner sub-samples are the farthest from the centre.
+    const double max_offset = std::hypot(frame_.width + 1.0, frame_.height + 1.0) * real_inc_ / 2.0;
+    const std::uint64_t max_skip = series_enabled_ ? max_series_skip_ : 0;
+    series_.compute(reference_, max_offset, real_inc_,
+                    iteration_cap_ ? std::min(iteration_cap_, max_skip) : max_skip);
+    // Every sub-sample starts out this far along, so the count of passes
+    // does too.
+    iterations_run_ = series_.skipped();
+  }
+
+  // Perturbed pixels are placed by their offset from the centre.
+  real_left_ = (perturbed_ ? 0.0 : reference_.real()) - real_width_ / 2.0;
+  imag_top_ = (perturbed_ ? 0.0 : reference_.imag()) + real_inc_ * frame_.height / 2.0;
+
+  live_bins_ = bin_finished_.size();
+  live_bins_list_.clear();
+  focus_changed_ = true;
+  for (std::size_t bin_index = 0; bin_index < bin_finished_.size(); ++bin_index) {
+    live_bins_list_.push_back(static_cast<std::uint32_t>(bin_index));
+    bin_finished_[bin_index] = false;
+    bin_phase_[bin_index] = centres;
+  }
+  // Each worker sets up the bins it owns, so that their pages are first
+  // touched from its core.
+  workers_.run([this](unsigned worker) {
+    const unsigned tile_bins = tile_width_ / bin_width_;
+    for (std::size_t tile = worker; tile < tile_done_.size(); tile += queues_.size()) {
+      const unsigned left = tile % tiles_wide_ * tile_bins;
+      const unsigned top = tile / tiles_wide_ * tile_bins;
+      for (unsigned y = top; y < std::min(top + tile_bins, bins_high_); ++y) {
+        for (unsigned x = left; x < std::min(left + tile_bins, bins_wide_); ++x) {
+          start_bin(std::size_t(y) * bins_wide_ + x);
+        }
+      }
+    }
+  });
+
+  this->start_regions();
+
+  // Until a sub-sample escapes it is drawn as interior, so that is where
+  // every count starts; the whole frame is recoloured to match.
+  std::fill(sample_counts_.begin(), sample_counts_.end(), std::numeric_limits<float>::quiet_NaN());
+  std::fill(bin_dirty_.begin(), bin_dirty_.end(), true);
+  std::fill(tile_done_.begin(), tile_done_.end(), false);
+  if (tile_cache_) {
+    load_cached_tiles();
+  }
+}
+
+void MandelbrotEngine::start_bin(std::size_t bin_index)
+{
+  Bin& bin = bins_[bin_index];
+  bin.start = 0;
+  bin.fixed = 0;
+  bin.live = 0;
+  const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+  const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+  for (unsigned offset = 0; offset < bin_pixels_; ++offset) {
+    IterateLanes& lanes = bin.centres[offset / IterateLanes::width];
+    const unsigned lane = offset % IterateLanes::width;
+    if (lane == 0) {
+      lanes.escaped_bits = lanes.bounded_bits = 0;
+    }
+    const unsigned y = y_start + offset / bin_width_;
+    const unsigned x = x_start + offset % bin_width_;
+    if (x >= frame_.width || y >= frame_.height) {
+      lanes.retire(lane);
+      bin.fixed |= std::uint64_t(1) << offset;
+      continue;
+    }
+    // Exactly where ScreenPixel puts sub-sample 0.
+    const double real = pixel_left(x) + 0.5 * real_inc_;
+    const double imag = pixel_top(y) - 0.5 * real_inc_;
+    if (perturbed_) {
+      lanes.set_offset(lane, real, imag);
+      series_.start_lane(lanes, lane);
+    } else {
+      lanes.set(lane, real, imag);
+    }
+  }
+}
+
+void MandelbrotEngine::keep_previous()
+{
+  previous_counts_ = sample_counts_;
+  previous_final_.assign(std::size_t(frame_.width) * frame_.height, true);
+  for (const std::uint32_t bin_index : live_bins_list_) {
+    if (bin_finished_[bin_index]) {
+      continue;
+    }
+    const Bin& bin = bins_[bin_index];
+    // Once refinement has started only the refined pixels still change.
+    const std::uint64_t settled = bin_phase_[bin_index] == refining ? ~bin.live : bin.fixed;
+    const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+    const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+    for (unsigned offset = 0; offset < bin_pixels_; ++offset) {
+      const unsigned y = y_start + offset / bin_width_;
+      const unsigned x = x_start + offset % bin_width_;
+      if (!(settled >> offset & 1)) {
+        previous_final_[std::size_t(y) * frame_.width + x] = false;
+      }
+    }
+  }
+}
+
+bool MandelbrotEngine::resample_previous(double left, double top, double size,
+                                         float* counts) const
+{
+  for (unsigned i = 0; i < samples_; ++i) {
+    const double x = left + sample_x_[i] * size;
+    const double y = top + sample_y_[i] * size;
+    if (x < 0.0 || y < 0.0 || x >= frame_.width || y >= frame_.height) {
+      return false;
+    }
+    const std::size_t pixel = std::size_t(y) * frame_.width + static_cast<unsigned>(x);
+    if (!previous_final_[pixel]) {
+      return false;
+    }
+
+    // When the pixels line up, every sub-sample lands exactly on its own
+    // kept counterpart.
+    const double x_within = x - std::floor(x);
+    const double y_within = y - std::floor(y);
+    unsigned nearest = 0;
+    double nearest_distance = std::numeric_limits<double>::infinity();
+    for (unsigned k = 0; k < samples_; ++k) {
+      const double distance = (sample_x_[k] - x_within) * (sample_x_[k] - x_within) +
+                              (sample_y_[k] - y_within) * (sample_y_[k] - y_within);
+      if (distance < nearest_distance) {
+        nearest = k;
+        nearest_distance = distance;
+      }
+    }
+    counts[i] = previous_counts_[pixel * samples_ + nearest];
+  }
+  return true;
+}
+
+void MandelbrotEngine::reuse_previous(double x_offset, double y_offset, double factor)
+{
+  // A new pixel at (x, y) covers the kept pixels from
+  // ((x - width / 2) * factor + width / 2 + x_offset, ...) for factor of them
+  // each way. Zooming in would need more detail than the kept counts have.
+  if (factor < 1.0) {
+    return;
+  }
+  const double x_origin = frame_.width / 2.0 * (1.0 - factor) + x_offset;
+  const double y_origin = frame_.height / 2.0 * (1.0 - factor) + y_offset;
+
+  for (const std::uint32_t bin_index : live_bins_list_) {
+    Bin& bin = bins_[bin_index];
+    const unsigned y_start = bin_index / bins_wide_ * bin_width_;
+    const unsigned x_start = bin_index % bins_wide_ * bin_width_;
+    for (unsigned offset = 0; offset < bin_pixels_; ++offset) {
+      if (bin.fixed >> offset & 1) {
+        continue;
+      }
+      const unsigned y = y_start + offset / bin_width_;
+      const unsigned x = x_start + offset % bin_width_;
+      if (!resample_previous(x_origin + x * factor, y_origin + y * factor, factor,
+                             &sample_counts_[(std::size_t(y) * frame_.width + x) * samples_])) {
+        // Partly written; the centre fills every entry again when it escapes.
+        std::fill_n(&sample_counts_[(std::size_t(y) * frame_.width + x) * samples_], samples_,
+                    std::numeric_limits<float>::quiet_NaN());
+        continue;
+      }
+      bin.fixed |= std::uint64_t(1) << offset;
+      bin.centres[offset / IterateLanes::width].retire(offset % IterateLanes::width);
+      if (factor != 1.0) {
+        // Borrowed from neighbouring points rather than iterated.
+        tile_done_[std::size_t(y / tile_width_) * tiles_wide_ + x / tile_width_] = true;
+      }
+    }
+
+    if (bin.fixed == all_pixels_) {
+      finish_bin(bin_index);
+    }
+  }
+
+  this->compact_live_bins();
+}
+
+void MandelbrotEngine::finish_bin(std::size_t bin_index)
+{
+  bin_finished_[bin_index] = true;
+  bins_.release(bin_index);
+  --live_bins_;
+}
+
+std::string MandelbrotEngine::tile_key(unsigned tile_x, unsigned tile_y) const
+{
+  // The centre only needs to be exact to a small fraction of a pixel.
+  const double pixel_width = real_width_ / frame_.width;
+  const double magnitude = std::max({ std::abs(reference_.real()), std::abs(reference_.imag()), 1.0 });
+  const int digits = static_cast<int>(std::ceil(std::log10(magnitude / pixel_width))) + 4;
+
+  std::ostringstream key;
+  key.precision(17);
+  key << "mandelbrot tile v3"
+      << " centre=" << reference_.real_text(digits) << ',' << reference_.imag_text(digits)
+      << " width=" << real_width_
+      << " size=" << frame_.width << 'x' << frame_.height
+      << " tile=" << tile_x << ',' << tile_y
+      << " cap=" << iteration_cap_
+      << " samples=" << samples_ << ',' << refine_threshold_
+      << " fill=" << region_fill_ << ',' << bin_width_
+      << " precision=" << lane_precision_name(precision_)
+      << " periodicity=" << periodicity_check().tolerance << ',' << periodicity_check().max_period;
+  return key.str();
+}
+
+void MandelbrotEngine::load_cached_tiles()
+{
+  std::vector<float> samples;
+  for (unsigned tile_y = 0; tile_y < tiles_high_; ++tile_y) {
+    for (unsigned tile_x = 0; tile_x < tiles_wide_; ++tile_x) {
+      const unsigned x_start = tile_x * tile_width_;
+      const unsigned y_start = tile_y * tile_width_;
+      const unsigned x_end = std::min(x_start + tile_width_, frame_.width);
+      const unsigned y_end = std::min(y_start + tile_width_, frame_.height);
+      const std::size_t row_samples = std::size_t(x_end - x_start) * samples_;
+      samples.resize(row_samples * (y_end - y_start));
+      if (!tile_cache_->load(tile_key(tile_x, tile_y), samples.data(), samples.size())) {
+        continue;
+      }
+
+      const float* counts = samples.data();
+      for (unsigned y = y_start; y < y_end; ++y, counts += row_samples) {
+        std::copy(counts, counts + row_samples,
+                  &sample_counts_[(std::size_t(y) * frame_.width + x_start) * samples_]);
+      }
+      for (unsigned bin_y = y_start / bin_width_; bin_y * bin_width_ < y_end; ++bin_y) {
+        for (unsigned bin_x = x_start / bin_width_; bin_x * bin_width_ < x_end; ++bin_x) {
+          const std::size_t bin_index = std::size_t(bin_y) * bins_wide_ + bin_x;
+          if (!bin_finished_[bin_index]) {
+            finish_bin(bin_index);
+          }
+        }
+      }
+      tile_done_[std::size_t(tile_y) * tiles_wide_ + tile_x] = true;
+    }
+  }
+
+  this->compact_live_bins();
+}
+
+void MandelbrotEngine::store_finished_tiles()
+{
+  std::vector<float> samples;
+  for (unsigned tile_y = 0; tile_y < tiles_high_; ++tile_y) {
+    for (unsigned tile_x = 0; tile_x < tiles_wide_; ++tile_x) {
+      unsigned char& done = tile_done_[std::size_t(tile_y) * tiles_wide_ + tile_x];
+      if (done) {
+        continue;
+      }
+      const unsigned x_start = tile_x * tile_width_;
+      const unsigned y_start = tile_y * tile_width_;
+      const unsigned x_end = std::min(x_start + tile_width_, frame_.width);
+      const unsigned y_end = std::min(y_start + tile_width_, frame_.height);
+
+      bool finished = true;
+      for (unsigned bin_y = y_start / bin_width_; finished && bin_y * bin_width_ < y_end; ++bin_y) {
+        for (unsigned bin_x = x_start / bin_width_; bin_x * bin_width_ < x_end; ++bin_x) {
+          finished = finished && bin_finished_[std::size_t(bin_y) * bins_wide_ + bin_x];
+        }
+      }
+      if (!finished) {
+        continue;
+      }
+
+      const std::size_t row_samples = std::size_t(x_end - x_start) * samples_;
+      samples.resize(row_samples * (y_end - y_start));
+      for (unsigned y = y_start; y < y_end; ++y) {
+        const float* row = &sample_counts_[(std::size_t(y) * frame_.width + x_start) * samples_];
+        std::copy(row, row + row_samples, &samples[(y - y_start) * row_samples]);
+      }
+      // A tile that cannot be written is not retried.
+      tile_cache_->store(tile_key(tile_x, tile_y), samples.data(), samples.size());
+      done = true;
+    }
+  }
+}
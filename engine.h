@@ -0,0 +1,477 @@
+#pragma once
+#include "mandelbrot.h"
+#include "WorkerPool.h"
+#include "PageArena.h"
+#include "palette.h"
+#include "tile_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The compute core: the pixel grid, the bins that schedule it and the worker
+// threads that iterate it. Passes only store the smooth count of every
+// sub-sample; the RGB frame is coloured from those counts when it is asked
+// for, and only where they changed. The engine has no GL or windowing
+// dependency, so it can run headless.
+//
+// Anti-aliasing is adaptive. Each pixel's centre is iterated alone first,
+// eight pixels to a lane group. Only pixels whose centre differs from a
+// neighbour's are then refined with the rest of their sub-samples; the
+// others are drawn from the centre alone.
+class MandelbrotEngine {
+public:
+  struct Frame {
+    std::uint32_t width = 0;
+    std::uint32_t height = 0;
+    static constexpr std::size_t color_channels = 3;
+    // Rows of width * color_channels bytes, top row first.
+    std::vector<std::uint8_t> texture_data;
+    // The frame is also split into tile_width square tiles, row-major, the
+    // last row and column possibly partial. A tile's version changes
+    // whenever any of its pixels is recoloured, so copies of the frame can
+    // be brought up to date tile by tile.
+    static constexpr unsigned tile_width = 64;
+    std::vector<std::uint64_t> tile_versions;
+
+    unsigned tiles_wide() const { return (width + tile_width - 1) / tile_width; }
+    // Copies the tiles whose version differs from the source's, or all of
+    // source if the size differs.
+    void update_from(const Frame& source);
+  };
+
+  // Counters kept by one worker. Each worker writes only its own entry, and
+  // entries are padded apart so workers never share a cache line.
+  struct WorkerStats {
+    std::uint64_t iterations = 0;
+    std::uint64_t pixels_finalized = 0;
+    std::uint64_t bins = 0;
+    // Time spent processing bins, as opposed to waiting for the next pass.
+    std::chrono::steady_clock::duration busy{};
+  };
+
+  // Where the time goes, by phase. Passes split into queue, the engine's
+  // own bookkeeping between passes (sorting and compacting the bin list,
+  // resolving regions, storing tiles), and iterate, the wall time the
+  // workers are out on bins. colour is spent in frame(), outside passes.
+  struct Stats {
+    std::uint64_t passes = 0;
+    // Wall time spent inside run_pass: queue plus iterate.
+    std::chrono::steady_clock::duration elapsed{};
+    std::chrono::steady_clock::duration queue{};
+    std::chrono::steady_clock::duration iterate{};
+    std::chrono::steady_clock::duration colour{};
+    // Time spent getting frames on screen. The engine never uploads, so it
+    // leaves this zero for whoever displays its frames to fill in.
+    std::chrono::steady_clock::duration upload{};
+    // Bins not finished yet, when the stats were taken.
+    std::size_t live_bins = 0;
+    // Pixels finished by region fill without being iterated; included in
+    // pixels_finalized().
+    std::uint64_t pixels_filled = 0;
+    std::vector<WorkerStats> workers;
+
+    std::uint64_t iterations() const;
+    std::uint64_t pixels_finalized() const;
+    // Time a worker spent in passes without a bin to work on.
+    std::chrono::steady_clock::duration idle(const WorkerStats& worker) const
+    {
+      return iterate - worker.busy;
+    }
+    // Writes the stats as one line of JSON, times in seconds, so that
+    // periodic dumps make a JSON Lines file.
+    void write_json(std::ostream& out) const;
+  };
+
+public:
+  // A thread_count of zero uses one worker per hardware thread.
+  MandelbrotEngine(std::uint32_t width, std::uint32_t height, unsigned thread_count = 0);
+
+  // Advances every live pixel by up to the iteration budget, bins nearest
+  // the focus first. If stop is given, the pass ends early once *stop is
+  // nonzero, which may be set from any thread: workers finish the bin they
+  // are on and the bins not reached yet just fall one pass behind.
+  void run_pass(const std::atomic<unsigned>* stop = nullptr);
+  // True once every pixel is final or has reached the iteration cap.
+  bool converged() const;
+
+  // Restarts the render for new bounds. width is the real extent of the frame.
+  void set_view(double real_center, double imag_center, double width);
+  // As above with the centre in decimal, to any precision, then moved by an
+  // offset in the plane. The offset is added in arbitrary precision, so a
+  // frame can be set to part of a larger view at any depth. Returns false
+  // and leaves the view alone if either coordinate does not parse.
+  bool set_view(const std::string& real_center, const std::string& imag_center, double width,
+                double real_offset = 0.0, double imag_offset = 0.0);
+  // Recentres on a frame position, measured in pixels from the top left, and
+  // scales the real extent by factor. The centre is moved in arbitrary
+  // precision, so zooming can go on far past the resolution of a double.
+  void zoom_at(double x, double y, double factor);
+  // Moves the view by whole pixels; positive dx moves right, positive dy down.
+  void pan(int dx, int dy);
+  // Gives priority to the part of the frame around a position in pixels,
+  // measured from the top left: its bins are handed out first in every
+  // pass, and bins further away get a smaller share of the iteration budget
+  // (see focus_ring_). Kept through view changes and resizes, relative to
+  // the frame size. Without a focus every bin gets the full budget.
+  void set_focus(double x, double y);
+  // Changes the resolution and restarts the render of the current view. Does
+  // nothing if the size is unchanged.
+  void resize(std::uint32_t width, std::uint32_t height);
+  // Maps a frame position in pixels, measured from the top left, to the
+  // complex plane.
+  void screen_to_complex(double& real, double& imag, double x, double y) const;
+
+  // Fixes the number of iterations each pixel advances per pass.
+  // Disables the frame time target.
+  void set_iteration_budget(unsigned iterations);
+  // Rescales the per-pass iteration budget after every pass so that a pass
+  // takes about this long. Zero keeps the current budget fixed.
+  void set_frame_time_target(std::chrono::microseconds target);
+  unsigned iteration_budget() const { return iteration_budget_; }
+  // Sub-samples still live after this many iterations are drawn as
+  // interior, or like their pixel's centre if that escaped. Zero means no
+  // cap.
+  void set_iteration_cap(std::uint64_t iterations) { iteration_cap_ = iterations; }
+  // Sub-samples per refined pixel, from 1 (no anti-aliasing) up to
+  // ScreenPixel::subsamples. Restarts the current view.
+  void set_samples(unsigned samples);
+  unsigned samples() const { return samples_; }
+  // A pixel is refined when its centre's smooth count differs by more than
+  // this from a neighbour's, or when one of the two escaped and the other
+  // did not. Zero refines every pixel next to any change at all. Restarts
+  // the current view.
+  void set_refine_threshold(double iterations);
+  // Reads finished tiles from, and stores them to, a tile cache in directory
+  // (see TileCache); an empty directory turns caching off. Restarts the
+  // current view so that it is read from the cache.
+  void set_tile_cache(const std::string& directory);
+  // Lets views iterate in single precision wherever its resolution is
+  // plenty for the pixel spacing (see single_spacing_); deeper views are
+  // promoted to double, and deeper still to perturbation. Off by default,
+  // since single precision orbits drift from the double ones and slightly
+  // change the image. Restarts the current view.
+  void set_mixed_precision(bool enabled);
+  // The arithmetic of the current view, unless it is perturbed.
+  LanePrecision precision() const { return precision_; }
+  // Fills regions enclosed by interior points without iterating them (see
+  // Region). On by default. Restarts the current view.
+  void set_region_fill(bool enabled);
+  bool region_fill() const { return region_fill_; }
+  // Lets perturbed views skip the iterations every pixel shares through a
+  // series approximation. On by default; off iterates every pixel from the
+  // start, which is slower but checks the approximation. Restarts the
+  // current view.
+  void set_series_approximation(bool enabled);
+  // Makes bins width pixels square and restarts the current view. Bins are
+  // the unit of scheduling: larger ones are cheaper to hand out and keep
+  // more of a worker's pixels together, smaller ones stop sooner where the
+  // image is simple. Returns false and changes nothing for a width that
+  // bin_width_supported() rejects.
+  bool set_bin_width(unsigned width);
+  // Whether width divides the tile width, fills whole lane groups and is at
+  // most max_bin_width_, which leaves 4 and 8.
+  static bool bin_width_supported(unsigned width);
+  unsigned bin_width() const { return bin_width_; }
+  // Pins every worker to a CPU of its own where the platform allows it,
+  // then restarts the current view so that the bins' memory is laid out
+  // afresh from the pinned workers (see bin_owner()). Returns whether every
+  // worker was pinned.
+  bool pin_threads();
+
+  // Colours every sub-sample from now on. The next frame() recolours the
+  // whole view from the stored counts without iterating anything.
+  void set_palette(const Palette& palette);
+  const Palette& palette() const { return palette_; }
+
+  // Colours the pixels whose counts changed since the last call, then
+  // returns the frame. Not to be called during a pass.
+  const Frame& frame();
+  // Copies the smooth counts of a rectangle of pixels, samples() per pixel,
+  // row by row, as a Palette colours them. Not to be called during a pass.
+  void read_counts(std::uint32_t x, std::uint32_t y, std::uint32_t width, std::uint32_t height,
+                   float* counts) const;
+  // Totals since construction or the last reset_stats(). Only consistent
+  // between passes.
+  Stats stats() const;
+  void reset_stats();
+  // The centre rounded to double; see the text forms for the exact value.
+  double real_center() const { return reference_.real(); }
+  double imag_center() const { return reference_.imag(); }
+  std::string real_center_text() const { return reference_.real_text(); }
+  std::string imag_center_text() const { return reference_.imag_text(); }
+  double real_width() const { return real_width_; }
+  std::uint32_t width() const { return frame_.width; }
+  std::uint32_t height() const { return frame_.height; }
+  // True when the view is too narrow for doubles and pixels are iterated by
+  // perturbation against a reference orbit at the centre.
+  bool perturbed() const { return perturbed_; }
+  unsigned thread_count() const { return workers_.size(); }
+
+private:
+  // Sets up Pixels according to the current bounds.
+  void initialize();
+  // Keeps the current counts and which of their pixels are final, to seed
+  // the next view from.
+  void keep_previous();
+  // Marks the pixels of the new view that the kept counts already determine
+  // as final, writing their counts straight into sample_counts_. The new
+  // view must be the kept one scaled by factor (at least 1) about the point
+  // (x_offset, y_offset) pixels from its centre.
+  void reuse_previous(double x_offset, double y_offset, double factor);
+  // Fills in the counts of one new pixel, given in kept pixel units, from
+  // the kept sub-sample nearest each of its own. False unless every kept
+  // pixel under it is final.
+  bool resample_previous(double left, double top, double size, float* counts) const;
+  // Fills every tile of the view found in the tile cache and finishes its
+  // bins.
+  void load_cached_tiles();
+  // Stores the tiles whose bins have all finished.
+  void store_finished_tiles();
+  // Identifies one tile of the current view across runs and machines.
+  std::string tile_key(unsigned tile_x, unsigned tile_y) const;
+  // Finishes a bin whose pixels were filled in without iterating them.
+  void finish_bin(std::size_t bin_index);
+  void allocate(std::uint32_t width, std::uint32_t height);
+  // Sets up a bin's centres for the current view.
+  void start_bin(std::size_t bin_index);
+  // Index of the tile a bin lies in, row by row.
+  std::size_t bin_tile(std::size_t bin_index) const;
+  // The worker a bin belongs to; see queues_.
+  unsigned bin_owner(std::size_t bin_index) const;
+  // Drops finished bins from live_bins_list_, keeping the rest in order.
+  void compact_live_bins();
+  void process_next_bin(unsigned worker, const std::atomic<unsigned>* stop);
+  // The two phases of a bin; each returns whether any counts changed.
+  bool iterate_centres(std::size_t bin_index, unsigned budget, WorkerStats& stats);
+  bool iterate_refined(std::size_t bin_index, unsigned budget, WorkerStats& stats);
+  // Picks the pixels of a bin to refine from its centre counts and those of
+  // the pixels around it, and sets them up.
+  bool start_refinement(std::size_t bin_index, WorkerStats& stats);
+  // Moves bins whose centres are done to refine_ready once every bin around
+  // them has its centres done too.
+  void release_waiting_bins();
+  // Makes each tile a region and holds the bins inside it.
+  void start_regions();
+  // Fills or splits every region whose border has been decided.
+  void resolve_regions();
+  // Lets a held bin be iterated, as if its lanes had started now.
+  void release_held_bin(std::size_t bin_index);
+  // Top-left corner of a pixel in the plane, or relative to the reference
+  // orbit when perturbed.
+  double pixel_left(unsigned x) const { return real_left_ + x * real_inc_; }
+  double pixel_top(unsigned y) const { return imag_top_ - y * real_inc_; }
+  // Sorts live_bins_list_ nearest the focus first and assigns every bin its
+  // ring.
+  void prioritize_bins();
+  // Recolours the bins marked in bin_dirty_, spread over the workers.
+  void color_dirty_bins();
+  void color_next_bin();
+  void adapt_iteration_budget(std::chrono::steady_clock::duration elapsed);
+  // Raises the precision of the centre to what a view of the given width
+  // needs. Never lowers it, so digits already given are kept.
+  void ensure_precision(double width);
+
+private:
+  Frame frame_;
+
+  // The view centre, held to arbitrary precision, and its orbit when the
+  // view is perturbed.
+  ReferenceOrbit reference_;
+  double real_width_ = 2.8;
+  // Below this pixel spacing, relative to the magnitude of the centre,
+  // neighbouring sub-samples are too few ulps apart for direct iteration.
+  static constexpr double perturbation_spacing_ = 1e-12;
+  bool perturbed_ = false;
+  // Below this pixel spacing, relative to the magnitude of the centre,
+  // single precision stops resolving sub-samples to a thousandth of a
+  // pixel.
+  static constexpr double single_spacing_ = 1e-4;
+  bool mixed_precision_ = false;
+  LanePrecision precision_ = LanePrecision::float64;
+  // Lets perturbed pixels skip the iterations they share with the centre.
+  // Bounded so that setting up a view never stalls for long.
+  SeriesApproximation series_;
+  bool series_enabled_ = true;
+  static constexpr std::uint64_t max_series_skip_ = 1u << 20;
+
+  // Bins are bin_width_ pixels square; see set_bin_width().
+  static constexpr unsigned max_bin_width_ = 8;
+  unsigned bin_width_ = 4;
+
+  // The budget restarts small after every change of view so that the first
+  // passes over a fully live grid stay interactive.
+  static constexpr unsigned initial_iteration_budget_ = 16;
+  static constexpr unsigned max_iteration_budget_ = 1u << 20;
+  unsigned iteration_budget_ = initial_iteration_budget_;
+  std::chrono::microseconds frame_time_target_ = std::chrono::milliseconds(30);
+  std::uint64_t iteration_cap_ = 0;
+  // Iterations run by the passes since the view was set up. Pixels that
+  // started with the view have run at most this many; see Bin::start.
+  std::uint64_t iterations_run_ = 0;
+  // Budget of the pass in flight; fixed for the duration of a pass.
+  unsigned pass_budget_ = 0;
+
+  // The focus as a fraction of the frame's width and height.
+  bool focused_ = false;
+  double focus_x_ = 0.5;
+  double focus_y_ = 0.5;
+  // Set when live_bins_list_ needs sorting again before the next pass.
+  bool focus_changed_ = false;
+  // Bins whose centre is within focus_ring_ of the frame's larger side of
+  // the focus are in ring 0, within twice that ring 1, and so on up to
+  // max_ring_. A bin in ring r runs pass_budget_ >> r iterations a pass.
+  static constexpr double focus_ring_ = 1.0 / 8.0;
+  static constexpr unsigned char max_ring_ = 3;
+  std::vector<unsigned char> bin_ring_;
+
+  // Sub-samples per refined pixel, and the refinement criterion.
+  unsigned samples_ = 8;
+  double refine_threshold_ = 1.0;
+  // Where pixel (0, 0) starts and the spacing of pixels, for the view being
+  // rendered.
+  double real_left_ = 0.0;
+  double imag_top_ = 0.0;
+  double real_inc_ = 0.0;
+
+  static constexpr unsigned max_bin_pixels_ = max_bin_width_ * max_bin_width_;
+  static_assert(max_bin_pixels_ <= 64, "a bin's pixels are bits of a 64-bit mask");
+  unsigned bin_pixels_ = 16;
+  std::uint64_t all_pixels_ = 0xffff;
+
+  // Iteration state of one bin's pixels, laid out so that only bins that
+  // are refined ever touch the pages of pixels. A bin gives its state up as
+  // soon as every pixel in it is final; from then on sample_counts_ alone
+  // holds it. Pixels are numbered by their offset y * bin_width_ + x. Only
+  // the first bin_pixels_ pixels exist; the arena's slots end there.
+  struct Bin {
+    // The bin's lanes have run iterations_run_ - start iterations, which
+    // the iteration cap applies to. Passes that run a bin for less than the
+    // full pass budget, or skip it, move start up by the difference.
+    std::uint64_t start;
+    // Pixels whose counts are settled without iterating: ones outside the
+    // frame or reused from the previous view.
+    std::uint64_t fixed;
+    // While refining, the refined pixels that are not final yet.
+    std::uint64_t live;
+    // The centre of pixel k is lane k % width of group k / width.
+    IterateLanes centres[max_bin_pixels_ / IterateLanes::width];
+    ScreenPixel pixels[max_bin_pixels_];
+  };
+
+  // A bin first iterates its centres. Once they are all done it waits for
+  // the bins around it, whose centres the refinement criterion reads, then
+  // picks pixels to refine and iterates those.
+  // Bins inside a region start out held and are not iterated at all.
+  enum BinPhase : unsigned char { held, centres, centres_done, refine_ready, refining };
+
+  // Bins cover the frame row-major; the last row and column of bins may hang
+  // over the frame's edge, and the pixels outside it are never touched. A
+  // finished bin's slot in bins_ is released back to the operating system.
+  unsigned bins_wide_ = 0;
+  unsigned bins_high_ = 0;
+  std::vector<unsigned char> bin_finished_;
+  std::vector<BinPhase> bin_phase_;
+  std::atomic<std::size_t> live_bins_{0};
+  PageArena<Bin> bins_;
+
+  // Mariani-Silver fill. A region is a rectangle of bins, inclusive, whose
+  // border bins are iterated while the bins strictly inside are held. Once
+  // every pixel centre on the region's outer edge is done and none escaped,
+  // the held bins are finished as interior: the complement of the set is
+  // connected, so nothing enclosed by interior points can escape, short of
+  // filaments thin enough to slip between the samples. As soon as one of
+  // them escapes, the region is split in two along a line of held bins,
+  // which are released to become border of the halves.
+  struct Region {
+    unsigned left, top, right, bottom;
+    // iterations_run_ when the region was made. A border still undecided
+    // after region_wait_ more iterations is treated as escaped, so that
+    // without an iteration cap a slow border cannot hold its inside back
+    // for good.
+    std::uint64_t start;
+  };
+  static constexpr std::uint64_t region_wait_ = 1u << 16;
+  bool region_fill_ = true;
+  std::vector<Region> regions_;
+  std::vector<Region> split_regions_;
+
+  // The counts of the previous view and a flag per pixel telling whether it
+  // was final. Only kept across zoom_at() and pan(), which know exactly how
+  // the two views line up.
+  std::vector<unsigned char> previous_final_;
+  std::vector<float> previous_counts_;
+  // Where ScreenPixel puts its sub-samples; see ScreenPixel::samplePositions.
+  double sample_x_[ScreenPixel::subsamples];
+  double sample_y_[ScreenPixel::subsamples];
+
+  // What the frame is coloured from: samples_ smooth counts per pixel,
+  // row-major, as written by ScreenPixel::sampleCounts. The first is the
+  // centre's; until a refined sub-sample is done it holds the centre's
+  // count too. Kept up to date for live pixels, so it always matches the
+  // view.
+  std::vector<float> sample_counts_;
+  Palette palette_ = Palette::builtins().front();
+  // Per bin, set when the counts of any of its pixels changed since the
+  // frame was last coloured. A pass writes only the flags of the bins it
+  // processes, one worker per bin.
+  std::vector<unsigned char> bin_dirty_;
+  // The dirty bins of the colouring in progress, claimed through next_bin_.
+  std::vector<std::uint32_t> dirty_bins_list_;
+  // Counts calls to frame(), each of which gives the tiles it recolours
+  // this version. Never reset, so no version is reused, even across a
+  // resize.
+  std::uint64_t frame_version_ = 0;
+
+  // The tiles of the frame are also the unit of the tile cache. Tile edges
+  // fall on bin edges, and the last row and column may be partial.
+  static constexpr unsigned tile_width_ = Frame::tile_width;
+  static_assert(tile_width_ % max_bin_width_ == 0, "tiles are made of whole bins");
+  unsigned tiles_wide_ = 0;
+  unsigned tiles_high_ = 0;
+  // Per tile, set once it has been stored or loaded, or when it holds pixels
+  // resampled from a previous view and so must not be stored.
+  std::vector<unsigned char> tile_done_;
+  std::unique_ptr<TileCache> tile_cache_;
+
+  struct PaddedWorkerStats {
+    WorkerStats stats;
+    char padding[64];
+  };
+  std::vector<PaddedWorkerStats> worker_stats_;
+  std::uint64_t stats_passes_ = 0;
+  std::uint64_t stats_pixels_filled_ = 0;
+  std::chrono::steady_clock::duration stats_queue_{};
+  std::chrono::steady_clock::duration stats_iterate_{};
+  std::chrono::steady_clock::duration stats_colour_{};
+
+  static constexpr unsigned max_thread_count_ = 128;
+  // Indices of the bins that are not finished, in increasing order or
+  // nearest the focus first. Finished bins are dropped after every pass, so
+  // a pass costs nothing for converged regions. Capacity is reserved for
+  // every bin when the resolution is set.
+  std::vector<std::uint32_t> live_bins_list_;
+  // Every bin belongs to one worker for as long as the resolution and bin
+  // width stay the same: the owner of its tile, with tiles dealt out to
+  // the workers in turn, row-major, so that each holds some near the
+  // focus. Every pass splits the bins due for work into one queue per
+  // owner, in live_bins_list_ order. A worker claims from its own queue
+  // first and only then from the others', so each bin's state is set up
+  // by, and mostly stays in the caches and on the memory node of, the same
+  // core pass after pass. Claiming is one atomic increment of a queue's
+  // next, with no lock and no allocation.
+  struct WorkerQueue {
+    std::vector<std::uint32_t> bins;
+    std::atomic<std::size_t> next{0};
+    char padding[64];
+  };
+  std::vector<WorkerQueue> queues_;
+  // Claims the dirty bins of a colouring the same way, from one list.
+  std::atomic<std::size_t> next_bin_{0};
+
+  // Declared last so workers are joined before the state they touch goes away.
+  WorkerPool workers_;
+};
@@ -0,0 +1,217 @@
+#include "image_writer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+class PpmWriter : public ImageWriter {
+public:
+  PpmWriter(std::FILE* file, std::uint32_t width, std::uint32_t height)
+    : ImageWriter(file, width, height)
+  {
+    std::fprintf(file_, "P6\n%u %u\n255\n", width_, height_);
+  }
+
+  void write_rows(const std::uint8_t* rows, std::uint32_t count) override
+  {
+    write(rows, std::size_t(width_) * 3 * count);
+    rows_written_ += count;
+  }
+
+  void finish() override
+  {
+    close();
+  }
+};
+
+// Rows are deflated as they arrive and emitted as a sequence of IDAT chunks.
+class PngWriter : public ImageWriter {
+public:
+  PngWriter(std::FILE* file, std::uint32_t width, std::uint32_t height)
+    : ImageWriter(file, width, height), row_(1 + std::size_t(width) * 3),
+      out_(1 << 16)
+  {
+    static const std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    write(signature, sizeof signature);
+
+    std::uint8_t header[13];
+    put_u32(header, width_);
+    put_u32(header + 4, height_);
+    header[8] = 8;   // bits per channel
+    header[9] = 2;   // truecolour
+    header[10] = 0;  // deflate
+    header[11] = 0;  // adaptive filtering
+    header[12] = 0;  // no interlace
+    chunk("IHDR", header, sizeof header);
+
+    if (deflateInit(&stream_, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      throw std::runtime_error("deflateInit failed");
+    }
+    reset_output();
+  }
+
+  ~PngWriter() override
+  {
+    deflateEnd(&stream_);
+  }
+
+  void write_rows(const std::uint8_t* rows, std::uint32_t count) override
+  {
+    const std::size_t stride = std::size_t(width_) * 3;
+    for (std::uint32_t r = 0; r < count; ++r, rows += stride) {
+      // Sub filter: each byte minus the same channel of the pixel to its left.
+      // Smooth gradients then deflate far better than raw bytes.
+      row_[0] = 1;
+      for (std::size_t i = 0; i < stride; ++i) {
+        row_[1 + i] = rows[i] - (i >= 3 ? rows[i - 3] : 0);
+      }
+      deflate_bytes(row_.data(), row_.size(), Z_NO_FLUSH);
+    }
+    rows_written_ += count;
+  }
+
+  void finish() override
+  {
+    deflate_bytes(nullptr, 0, Z_FINISH);
+    flush_idat();
+    chunk("IEND", nullptr, 0);
+    close();
+  }
+
+private:
+  static void put_u32(std::uint8_t* p, std::uint32_t v)
+  {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  }
+
+  void chunk(const char* type, const std::uint8_t* data, std::size_t length)
+  {
+    std::uint8_t prefix[8];
+    put_u32(prefix, static_cast<std::uint32_t>(length));
+    std::copy(type, type + 4, prefix + 4);
+    write(prefix, sizeof prefix);
+    if (length) {
+      write(data, length);
+    }
+    uLong crc = crc32(0L, prefix + 4, 4);
+    crc = crc32(crc, data, static_cast<uInt>(length));
+    std::uint8_t suffix[4];
+    put_u32(suffix, static_cast<std::uint32_t>(crc));
+    write(suffix, sizeof suffix);
+  }
+
+  void reset_output()
+  {
+    stream_.next_out = out_.data();
+    stream_.avail_out = static_cast<uInt>(out_.size());
+  }
+
+  void flush_idat()
+  {
+    const std::size_t used = out_.size() - stream_.avail_out;
+    if (used) {
+      chunk("IDAT", out_.data(), used);
+    }
+    reset_output();
+  }
+
+  void deflate_bytes(std::uint8_t* data, std::size_t length, int flush)
+  {
+    stream_.next_in = data;
+    stream_.avail_in = static_cast<uInt>(length);
+    for (;;) {
+      const int result = deflate(&stream_, flush);
+      if (result == Z_STREAM_ERROR) {
+        throw std::runtime_error("deflate failed");
+      }
+      if (stream_.avail_out == 0) {
+        flush_idat();
+        continue;
+      }
+      if (flush == Z_FINISH ? result == Z_STREAM_END : stream_.avail_in == 0) {
+        return;
+      }
+    }
+  }
+
+private:
+  z_stream stream_ = z_stream();
+  std::vector<std::uint8_t> row_;
+  std::vector<std::uint8_t> out_;
+};
+
+bool ends_with(const std::string& s, const std::string& suffix)
+{
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+}
+
+ImageWriter::ImageWriter(std::FILE* file, std::uint32_t width, std::uint32_t height)
+  : file_(file), width_(width), height_(height)
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+  if (file_ && file_ != stdout) {
+    std::fclose(file_);
+  }
+  if (!temporary_.empty()) {
+    std::remove(temporary_.c_str());
+  }
+}
+
+void ImageWriter::write(const void* data, std::size_t bytes)
+{
+  if (std::fwrite(data, 1, bytes, file_) != bytes) {
+    throw std::runtime_error("short write");
+  }
+}
+
+void ImageWriter::close()
+{
+  if (rows_written_ != height_) {
+    throw std::runtime_error("image closed before every row was written");
+  }
+  const bool failed = file_ != stdout ? std::fclose(file_) != 0 : std::fflush(file_) != 0;
+  file_ = nullptr;
+  if (failed) {
+    throw std::runtime_error("could not close image file");
+  }
+  if (!temporary_.empty()) {
+    if (std::rename(temporary_.c_str(), path_.c_str()) != 0) {
+      throw std::runtime_error("cannot rename " + temporary_ + " to " + path_);
+    }
+    temporary_.clear();
+  }
+}
+
+std::unique_ptr<ImageWriter> ImageWriter::open(const std::string& path,
+                                               std::uint32_t width, std::uint32_t height)
+{
+  if (path == "-") {
+    return std::unique_ptr<ImageWriter>(new PpmWriter(stdout, width, height));
+  }
+  const std::string temporary = path + ".tmp";
+  std::FILE* file = std::fopen(temporary.c_str(), "wb");
+  if (!file) {
+    throw std::runtime_error("cannot open " + temporary);
+  }
+  std::unique_ptr<ImageWriter> image;
+  try {
+    if (ends_with(path, ".png")) {
+      image.reset(new PngWriter(file, width, height));
+    } else {
+      image.reset(new PpmWriter(file, width, height));
+    }
+  } catch (...) {
+    std::remove(temporary.c_str());
+    throw;
+  }
+  image->path_ = path;
+  image->temporary_ = temporary;
+  return image;
+}
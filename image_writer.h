@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+// Streams an 8-bit RGB image to a file top row first, so an image never has
+// to be resident in full. Errors are reported by throwing std::runtime_error.
+class ImageWriter {
+public:
+  virtual ~ImageWriter();
+
+  // Appends count rows of width * 3 bytes each.
+  virtual void write_rows(const std::uint8_t* rows, std::uint32_t count) = 0;
+  // Writes any trailer and closes the file. Every row must have been written.
+  virtual void finish() = 0;
+
+  // Picks the format from the extension: ".png" writes PNG, anything else
+  // binary PPM. A path of "-" writes PPM to standard output. Files are
+  // written under a temporary name and renamed to path by finish(), so an
+  // image that is never finished leaves no file behind.
+  static std::unique_ptr<ImageWriter> open(const std::string& path,
+                                           std::uint32_t width, std::uint32_t height);
+
+protected:
+  ImageWriter(std::FILE* file, std::uint32_t width, std::uint32_t height);
+  void write(const void* data, std::size_t bytes);
+  void close();
+
+protected:
+  std::FILE* file_;
+  const std::uint32_t width_;
+  const std::uint32_t height_;
+  std::uint32_t rows_written_ = 0;
+  // Where the image goes once finished; empty when writing to stdout.
+  std::string path_;
+  // Where it is written until then; removed if it never gets there.
+  std::string temporary_;
+};
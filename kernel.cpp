@@ -0,0 +1,581 @@
+#include "kernel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MANDEL_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace {
+PeriodicityCheck current_check;
+}
+
+void set_periodicity_check(const PeriodicityCheck& check)
+{
+  current_check = check;
+  if (current_check.max_period < 1) {
+    current_check.max_period = 1;
+  }
+}
+
+const PeriodicityCheck& periodicity_check()
+{
+  return current_check;
+}
+
+bool in_cardioid_or_bulb(double real, double imag)
+{
+  const double imag_sqr = imag * imag;
+  const double shifted = real - 0.25;
+  const double q = shifted * shifted + imag_sqr;
+  if (q * (q + shifted) <= 0.25 * imag_sqr) {
+    return true;
+  }
+  const double bulb = real + 1.0;
+  return bulb * bulb + imag_sqr <= 0.0625;
+}
+
+void IterateLanes::set(unsigned lane, double r, double i)
+{
+  start_real[lane] = real[lane] = check_real[lane] = r;
+  start_imag[lane] = imag[lane] = check_imag[lane] = i;
+  check_at[lane] = 1;
+  iterations[lane] = 0;
+  adjusted_count[lane] = 0.0f;
+  escaped_bits &= ~(1u << lane);
+  if (in_cardioid_or_bulb(r, i)) {
+    bounded_bits |= 1u << lane;
+  } else {
+    bounded_bits &= ~(1u << lane);
+  }
+}
+
+void IterateLanes::set_offset(unsigned lane, double r, double i)
+{
+  // z_1 = c, so the offset starts out equal to the offset of c from the
+  // reference point, one iteration into the reference orbit.
+  start_real[lane] = real[lane] = r;
+  start_imag[lane] = imag[lane] = i;
+  reference_index[lane] = 1;
+  // Nothing to compare against before the first step replaces it.
+  check_real[lane] = check_imag[lane] = std::numeric_limits<double>::quiet_NaN();
+  check_at[lane] = 1;
+  iterations[lane] = 0;
+  adjusted_count[lane] = 0.0f;
+  escaped_bits &= ~(1u << lane);
+  bounded_bits &= ~(1u << lane);
+}
+
+float adjusted_count(std::int64_t count, double abs_sqr)
+{
+  return count - log(log(abs_sqr) / log(escape_value)) / log(2.0);
+}
+
+namespace {
+
+// Reference implementation, one lane at a time. Mirrors ComplexIterate::iterate.
+template <typename Scalar>
+std::uint64_t iterate_scalar(IterateLanes& l, unsigned max_steps)
+{
+  const Scalar escape = IterateTraits<Scalar>::escape_value;
+  const Scalar tolerance = static_cast<Scalar>(current_check.tolerance);
+  const std::int64_t max_period = current_check.max_period;
+  std::uint64_t total = 0;
+  for (unsigned lane = 0; lane < IterateLanes::width; ++lane) {
+    if (l.escaped(lane) || l.bounded(lane)) {
+      continue;
+    }
+    const Scalar sr = static_cast<Scalar>(l.start_real[lane]);
+    const Scalar si = static_cast<Scalar>(l.start_imag[lane]);
+    Scalar re = static_cast<Scalar>(l.real[lane]), im = static_cast<Scalar>(l.imag[lane]);
+    Scalar cr = static_cast<Scalar>(l.check_real[lane]);
+    Scalar ci = static_cast<Scalar>(l.check_imag[lane]);
+    std::int64_t check_at = l.check_at[lane];
+    std::int64_t count = l.iterations[lane];
+
+    for (unsigned step = 0; step < max_steps; ++step) {
+      const Scalar nr = re * re - im * im + sr;
+      const Scalar ni = re * im + im * re + si;
+      re = nr;
+      im = ni;
+      const Scalar abs_sqr = re * re + im * im;
+
+      bool done = false;
+      if (abs_sqr > escape) {
+        l.escaped_bits |= 1u << lane;
+        l.adjusted_count[lane] = adjusted_count(count, abs_sqr);
+        done = true;
+      } else {
+        const Scalar real_diff = re - cr;
+        const Scalar imag_diff = im - ci;
+        if (real_diff < tolerance && real_diff > -tolerance &&
+            imag_diff < tolerance && imag_diff > -tolerance) {
+          l.bounded_bits |= 1u << lane;
+          done = true;
+        }
+      }
+
+      if (count + 1 == check_at) {
+        cr = re;
+        ci = im;
+        check_at += std::min(check_at, max_period);
+      }
+      ++count;
+      if (done) {
+        break;
+      }
+    }
+
+    total += count - l.iterations[lane];
+    l.real[lane] = re;
+    l.imag[lane] = im;
+    l.check_real[lane] = cr;
+    l.check_imag[lane] = ci;
+    l.check_at[lane] = check_at;
+    l.iterations[lane] = count;
+  }
+  return total;
+}
+
+#ifdef MANDEL_X86_KERNELS
+// Both vector kernels mirror iterate_scalar operation for operation. Lanes
+// that finish within a step still update the periodicity reference and count
+// in that step, exactly as the scalar code does; they are masked off
+// afterwards.
+// Building with -ffp-contract=off keeps the compiler from fusing the
+// multiplies and adds into FMAs, which would change the results.
+
+// Two registers of 4 lanes each, interleaved for instruction-level
+// parallelism.
+__attribute__((target("avx2")))
+std::uint64_t iterate_avx2(IterateLanes& l, unsigned max_steps)
+{
+  constexpr unsigned halves = IterateLanes::width / 4;
+  const __m256d escape = _mm256_set1_pd(escape_value);
+  const __m256d tolerance = _mm256_set1_pd(current_check.tolerance);
+  const __m256d neg_tolerance = _mm256_set1_pd(-current_check.tolerance);
+  const __m256i max_period = _mm256_set1_epi64x(current_check.max_period);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi64x(1);
+
+  __m256d sr[halves], si[halves], re[halves], im[halves], cr[halves], ci[halves];
+  __m256d live[halves], escaped[halves], bounded[halves], escape_abs[halves];
+  __m256i count[halves], start_count[halves], escape_count[halves], check_at[halves];
+  for (unsigned h = 0; h < halves; ++h) {
+    sr[h] = _mm256_loadu_pd(l.start_real + 4 * h);
+    si[h] = _mm256_loadu_pd(l.start_imag + 4 * h);
+    re[h] = _mm256_loadu_pd(l.real + 4 * h);
+    im[h] = _mm256_loadu_pd(l.imag + 4 * h);
+    cr[h] = _mm256_loadu_pd(l.check_real + 4 * h);
+    ci[h] = _mm256_loadu_pd(l.check_imag + 4 * h);
+    check_at[h] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(l.check_at + 4 * h));
+    count[h] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(l.iterations + 4 * h));
+    start_count[h] = count[h];
+    escape_count[h] = zero;
+    escaped[h] = bounded[h] = escape_abs[h] = _mm256_setzero_pd();
+
+    const unsigned finished = (l.escaped_bits | l.bounded_bits) >> (4 * h);
+    live[h] = _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+        _mm256_and_si256(_mm256_set_epi64x(finished & 8, finished & 4, finished & 2, finished & 1),
+                         _mm256_set_epi64x(8, 4, 2, 1)),
+        zero));
+  }
+
+  unsigned any_live = 0;
+  for (unsigned h = 0; h < halves; ++h) {
+    any_live |= _mm256_movemask_pd(live[h]);
+  }
+
+  for (unsigned step = 0; step < max_steps && any_live; ++step) {
+    any_live = 0;
+    for (unsigned h = 0; h < halves; ++h) {
+      const __m256d nr = _mm256_add_pd(
+          _mm256_sub_pd(_mm256_mul_pd(re[h], re[h]), _mm256_mul_pd(im[h], im[h])), sr[h]);
+      const __m256d ni = _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(re[h], im[h]), _mm256_mul_pd(im[h], re[h])), si[h]);
+      const __m256d abs_sqr = _mm256_add_pd(_mm256_mul_pd(nr, nr), _mm256_mul_pd(ni, ni));
+
+      const __m256d now_escaped = _mm256_and_pd(live[h], _mm256_cmp_pd(abs_sqr, escape, _CMP_GT_OQ));
+      const __m256d real_diff = _mm256_sub_pd(nr, cr[h]);
+      const __m256d imag_diff = _mm256_sub_pd(ni, ci[h]);
+      __m256d near = _mm256_and_pd(_mm256_cmp_pd(real_diff, tolerance, _CMP_LT_OQ),
+                                   _mm256_cmp_pd(real_diff, neg_tolerance, _CMP_GT_OQ));
+      near = _mm256_and_pd(near, _mm256_cmp_pd(imag_diff, tolerance, _CMP_LT_OQ));
+      near = _mm256_and_pd(near, _mm256_cmp_pd(imag_diff, neg_tolerance, _CMP_GT_OQ));
+      const __m256d now_bounded = _mm256_andnot_pd(now_escaped, _mm256_and_pd(live[h], near));
+
+      escape_abs[h] = _mm256_blendv_pd(escape_abs[h], abs_sqr, now_escaped);
+      escape_count[h] = _mm256_castpd_si256(_mm256_blendv_pd(
+          _mm256_castsi256_pd(escape_count[h]), _mm256_castsi256_pd(count[h]), now_escaped));
+      escaped[h] = _mm256_or_pd(escaped[h], now_escaped);
+      bounded[h] = _mm256_or_pd(bounded[h], now_bounded);
+
+      const __m256d move_check = _mm256_and_pd(live[h], _mm256_castsi256_pd(
+          _mm256_cmpeq_epi64(_mm256_add_epi64(count[h], one), check_at[h])));
+      const __m256i period = _mm256_castpd_si256(_mm256_blendv_pd(
+          _mm256_castsi256_pd(check_at[h]), _mm256_castsi256_pd(max_period),
+          _mm256_castsi256_pd(_mm256_cmpgt_epi64(check_at[h], max_period))));
+      cr[h] = _mm256_blendv_pd(cr[h], nr, move_check);
+      ci[h] = _mm256_blendv_pd(ci[h], ni, move_check);
+      check_at[h] = _mm256_add_epi64(check_at[h],
+          _mm256_and_si256(period, _mm256_castpd_si256(move_check)));
+
+      re[h] = _mm256_blendv_pd(re[h], nr, live[h]);
+      im[h] = _mm256_blendv_pd(im[h], ni, live[h]);
+      count[h] = _mm256_sub_epi64(count[h], _mm256_castpd_si256(live[h]));
+      live[h] = _mm256_andnot_pd(_mm256_or_pd(now_escaped, now_bounded), live[h]);
+      any_live |= _mm256_movemask_pd(live[h]);
+    }
+  }
+
+  std::uint64_t total = 0;
+  for (unsigned h = 0; h < halves; ++h) {
+    _mm256_storeu_pd(l.real + 4 * h, re[h]);
+    _mm256_storeu_pd(l.imag + 4 * h, im[h]);
+    _mm256_storeu_pd(l.check_real + 4 * h, cr[h]);
+    _mm256_storeu_pd(l.check_imag + 4 * h, ci[h]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(l.check_at + 4 * h), check_at[h]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(l.iterations + 4 * h), count[h]);
+
+    std::int64_t counts[4], starts[4], escape_counts[4];
+    double escape_abss[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(counts), count[h]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(starts), start_count[h]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(escape_counts), escape_count[h]);
+    _mm256_storeu_pd(escape_abss, escape_abs[h]);
+    const unsigned escaped_bits = _mm256_movemask_pd(escaped[h]);
+    const unsigned bounded_bits = _mm256_movemask_pd(bounded[h]);
+    for (unsigned i = 0; i < 4; ++i) {
+      total += counts[i] - starts[i];
+      if ((escaped_bits >> i) & 1) {
+        l.adjusted_count[4 * h + i] = adjusted_count(escape_counts[i], escape_abss[i]);
+      }
+    }
+    l.escaped_bits |= escaped_bits << (4 * h);
+    l.bounded_bits |= bounded_bits << (4 * h);
+  }
+  return total;
+}
+
+// All lanes in one register, with finished lanes tracked in a mask register.
+__attribute__((target("avx512f")))
+std::uint64_t iterate_avx512(IterateLanes& l, unsigned max_steps)
+{
+  static_assert(IterateLanes::width == 8, "one AVX-512 register per lane group");
+  const __m512d escape = _mm512_set1_pd(escape_value);
+  const __m512d tolerance = _mm512_set1_pd(current_check.tolerance);
+  const __m512d neg_tolerance = _mm512_set1_pd(-current_check.tolerance);
+  const __m512i max_period = _mm512_set1_epi64(current_check.max_period);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i one = _mm512_set1_epi64(1);
+
+  const __m512d sr = _mm512_loadu_pd(l.start_real);
+  const __m512d si = _mm512_loadu_pd(l.start_imag);
+  __m512d re = _mm512_loadu_pd(l.real);
+  __m512d im = _mm512_loadu_pd(l.imag);
+  __m512d cr = _mm512_loadu_pd(l.check_real);
+  __m512d ci = _mm512_loadu_pd(l.check_imag);
+  __m512i check_at = _mm512_loadu_si512(l.check_at);
+  __m512i count = _mm512_loadu_si512(l.iterations);
+  const __m512i start_count = count;
+  __m512i escape_count = zero;
+  __m512d escape_abs = _mm512_setzero_pd();
+  __mmask8 live = static_cast<__mmask8>(~(l.escaped_bits | l.bounded_bits));
+  __mmask8 escaped = 0;
+  __mmask8 bounded = 0;
+
+  for (unsigned step = 0; step < max_steps && live; ++step) {
+    const __m512d nr = _mm512_add_pd(
+        _mm512_sub_pd(_mm512_mul_pd(re, re), _mm512_mul_pd(im, im)), sr);
+    const __m512d ni = _mm512_add_pd(
+        _mm512_add_pd(_mm512_mul_pd(re, im), _mm512_mul_pd(im, re)), si);
+    const __m512d abs_sqr = _mm512_add_pd(_mm512_mul_pd(nr, nr), _mm512_mul_pd(ni, ni));
+
+    const __mmask8 now_escaped = _mm512_mask_cmp_pd_mask(live, abs_sqr, escape, _CMP_GT_OQ);
+    const __m512d real_diff = _mm512_sub_pd(nr, cr);
+    const __m512d imag_diff = _mm512_sub_pd(ni, ci);
+    __mmask8 now_bounded = live & ~now_escaped;
+    now_bounded = _mm512_mask_cmp_pd_mask(now_bounded, real_diff, tolerance, _CMP_LT_OQ);
+    now_bounded = _mm512_mask_cmp_pd_mask(now_bounded, real_diff, neg_tolerance, _CMP_GT_OQ);
+    now_bounded = _mm512_mask_cmp_pd_mask(now_bounded, imag_diff, tolerance, _CMP_LT_OQ);
+    now_bounded = _mm512_mask_cmp_pd_mask(now_bounded, imag_diff, neg_tolerance, _CMP_GT_OQ);
+
+    escape_abs = _mm512_mask_mov_pd(escape_abs, now_escaped, abs_sqr);
+    escape_count = _mm512_mask_mov_epi64(escape_count, now_escaped, count);
+    escaped |= now_escaped;
+    bounded |= now_bounded;
+
+    const __mmask8 move_check = _mm512_mask_cmpeq_epi64_mask(
+        live, _mm512_add_epi64(count, one), check_at);
+    cr = _mm512_mask_mov_pd(cr, move_check, nr);
+    ci = _mm512_mask_mov_pd(ci, move_check, ni);
+    const __m512i period = _mm512_mask_mov_epi64(
+        check_at, _mm512_cmpgt_epi64_mask(check_at, max_period), max_period);
+    check_at = _mm512_mask_add_epi64(check_at, move_check, check_at, period);
+
+    re = _mm512_mask_mov_pd(re, live, nr);
+    im = _mm512_mask_mov_pd(im, live, ni);
+    count = _mm512_mask_add_epi64(count, live, count, one);
+    live &= ~(now_escaped | now_bounded);
+  }
+
+  _mm512_storeu_pd(l.real, re);
+  _mm512_storeu_pd(l.imag, im);
+  _mm512_storeu_pd(l.check_real, cr);
+  _mm512_storeu_pd(l.check_imag, ci);
+  _mm512_storeu_si512(l.check_at, check_at);
+  _mm512_storeu_si512(l.iterations, count);
+
+  std::int64_t starts[8], escape_counts[8];
+  double escape_abss[8];
+  _mm512_storeu_si512(starts, start_count);
+  _mm512_storeu_si512(escape_counts, escape_count);
+  _mm512_storeu_pd(escape_abss, escape_abs);
+  std::uint64_t total = 0;
+  for (unsigned i = 0; i < 8; ++i) {
+    total += l.iterations[i] - starts[i];
+    if ((escaped >> i) & 1) {
+      l.adjusted_count[i] = adjusted_count(escape_counts[i], escape_abss[i]);
+    }
+  }
+  l.escaped_bits |= escaped;
+  l.bounded_bits |= bounded;
+  return total;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 to_float(const double* d)
+{
+  return _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(d + 4)),
+                         _mm256_cvtpd_ps(_mm256_loadu_pd(d)));
+}
+
+__attribute__((target("avx2")))
+static inline void to_double(double* d, __m256 f)
+{
+  _mm256_storeu_pd(d, _mm256_cvtps_pd(_mm256_castps256_ps128(f)));
+  _mm256_storeu_pd(d + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)));
+}
+
+// Single precision: all 8 lanes in one register, where doubles need two.
+// Counts and periodicity checkpoints run relative to the iterations at
+// entry in 32 bits, and the gap to the next checkpoint, min(check_at,
+// max_period), is carried along: it doubles at every checkpoint until it
+// reaches max_period, exactly as check_at does in iterate_scalar.
+__attribute__((target("avx2")))
+std::uint64_t iterate_avx2_float(IterateLanes& l, unsigned max_steps)
+{
+  static_assert(IterateLanes::width == 8, "one AVX register of floats per lane group");
+  max_steps = std::min(max_steps, 1u << 30);
+  const std::int32_t far = std::numeric_limits<std::int32_t>::max();
+  const std::int32_t max_period =
+      static_cast<std::int32_t>(std::min<std::int64_t>(current_check.max_period, 1 << 30));
+
+  std::int32_t next_check[8], gap[8];
+  for (unsigned i = 0; i < 8; ++i) {
+    next_check[i] = static_cast<std::int32_t>(
+        std::min<std::int64_t>(l.check_at[i] - l.iterations[i], far));
+    gap[i] = static_cast<std::int32_t>(std::min<std::int64_t>(l.check_at[i], max_period));
+  }
+
+  const __m256 escape = _mm256_set1_ps(IterateTraits<float>::escape_value);
+  const __m256 tolerance = _mm256_set1_ps(static_cast<float>(current_check.tolerance));
+  const __m256 neg_tolerance = _mm256_set1_ps(-static_cast<float>(current_check.tolerance));
+  const __m256i period_cap = _mm256_set1_epi32(max_period);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256 sr = to_float(l.start_real);
+  const __m256 si = to_float(l.start_imag);
+  __m256 re = to_float(l.real);
+  __m256 im = to_float(l.imag);
+  __m256 cr = to_float(l.check_real);
+  __m256 ci = to_float(l.check_imag);
+  const __m256i start_check = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(next_check));
+  __m256i check = start_check;
+  __m256i period = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(gap));
+  __m256i steps = _mm256_setzero_si256();
+  __m256i escape_steps = steps;
+  __m256 escape_abs = _mm256_setzero_ps();
+  __m256 escaped = _mm256_setzero_ps();
+  __m256 bounded = _mm256_setzero_ps();
+
+  const unsigned finished = l.escaped_bits | l.bounded_bits;
+  const __m256i lane_bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  __m256 live = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+      _mm256_and_si256(_mm256_set1_epi32(finished), lane_bits), _mm256_setzero_si256()));
+
+  for (unsigned step = 0; step < max_steps && _mm256_movemask_ps(live); ++step) {
+    const __m256 nr = _mm256_add_ps(
+        _mm256_sub_ps(_mm256_mul_ps(re, re), _mm256_mul_ps(im, im)), sr);
+    const __m256 ni = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(re, im), _mm256_mul_ps(im, re)), si);
+    const __m256 abs_sqr = _mm256_add_ps(_mm256_mul_ps(nr, nr), _mm256_mul_ps(ni, ni));
+
+    const __m256 now_escaped = _mm256_and_ps(live, _mm256_cmp_ps(abs_sqr, escape, _CMP_GT_OQ));
+    const __m256 real_diff = _mm256_sub_ps(nr, cr);
+    const __m256 imag_diff = _mm256_sub_ps(ni, ci);
+    __m256 near = _mm256_and_ps(_mm256_cmp_ps(real_diff, tolerance, _CMP_LT_OQ),
+                                _mm256_cmp_ps(real_diff, neg_tolerance, _CMP_GT_OQ));
+    near = _mm256_and_ps(near, _mm256_cmp_ps(imag_diff, tolerance, _CMP_LT_OQ));
+    near = _mm256_and_ps(near, _mm256_cmp_ps(imag_diff, neg_tolerance, _CMP_GT_OQ));
+    const __m256 now_bounded = _mm256_andnot_ps(now_escaped, _mm256_and_ps(live, near));
+
+    escape_abs = _mm256_blendv_ps(escape_abs, abs_sqr, now_escaped);
+    escape_steps = _mm256_castps_si256(_mm256_blendv_ps(
+        _mm256_castsi256_ps(escape_steps), _mm256_castsi256_ps(steps), now_escaped));
+    escaped = _mm256_or_ps(escaped, now_escaped);
+    bounded = _mm256_or_ps(bounded, now_bounded);
+
+    const __m256 move_check = _mm256_and_ps(live, _mm256_castsi256_ps(
+        _mm256_cmpeq_epi32(_mm256_add_epi32(steps, one), check)));
+    cr = _mm256_blendv_ps(cr, nr, move_check);
+    ci = _mm256_blendv_ps(ci, ni, move_check);
+    check = _mm256_add_epi32(check, _mm256_and_si256(period, _mm256_castps_si256(move_check)));
+    period = _mm256_castps_si256(_mm256_blendv_ps(
+        _mm256_castsi256_ps(period),
+        _mm256_castsi256_ps(_mm256_min_epi32(_mm256_add_epi32(period, period), period_cap)),
+        move_check));
+
+    re = _mm256_blendv_ps(re, nr, live);
+    im = _mm256_blendv_ps(im, ni, live);
+    steps = _mm256_sub_epi32(steps, _mm256_castps_si256(live));
+    live = _mm256_andnot_ps(_mm256_or_ps(now_escaped, now_bounded), live);
+  }
+
+  to_double(l.real, re);
+  to_double(l.imag, im);
+  to_double(l.check_real, cr);
+  to_double(l.check_imag, ci);
+
+  std::int32_t step_counts[8], checks[8], escape_counts[8];
+  float escape_abss[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(step_counts), steps);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(checks), check);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(escape_counts), escape_steps);
+  _mm256_storeu_ps(escape_abss, escape_abs);
+  const unsigned escaped_bits = _mm256_movemask_ps(escaped);
+  std::uint64_t total = 0;
+  for (unsigned i = 0; i < 8; ++i) {
+    // A checkpoint clamped to far at entry cannot have been reached.
+    if (checks[i] != next_check[i]) {
+      l.check_at[i] = l.iterations[i] + checks[i];
+    }
+    if ((escaped_bits >> i) & 1) {
+      l.adjusted_count[i] = adjusted_count(l.iterations[i] + escape_counts[i], escape_abss[i]);
+    }
+    l.iterations[i] += step_counts[i];
+    total += step_counts[i];
+  }
+  l.escaped_bits |= escaped_bits;
+  l.bounded_bits |= _mm256_movemask_ps(bounded);
+  return total;
+}
+#endif
+
+bool isa_supported(KernelIsa isa)
+{
+  switch (isa) {
+  case KernelIsa::scalar:
+    return true;
+#ifdef MANDEL_X86_KERNELS
+  // current_isa is initialized before main, which may be before libgcc has
+  // probed the CPU.
+  case KernelIsa::avx2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  case KernelIsa::avx512:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#else
+  default:
+    return false;
+#endif
+  }
+  return false;
+}
+
+KernelIsa best_isa()
+{
+  if (isa_supported(KernelIsa::avx512)) {
+    return KernelIsa::avx512;
+  } else if (isa_supported(KernelIsa::avx2)) {
+    return KernelIsa::avx2;
+  }
+  return KernelIsa::scalar;
+}
+
+typedef std::uint64_t (*KernelFunc)(IterateLanes&, unsigned);
+
+KernelFunc kernel_for(KernelIsa isa)
+{
+  switch (isa) {
+#ifdef MANDEL_X86_KERNELS
+  case KernelIsa::avx2:
+    return iterate_avx2;
+  case KernelIsa::avx512:
+    return iterate_avx512;
+#endif
+  default:
+    return iterate_scalar<double>;
+  }
+}
+
+// Eight floats fill an AVX register, so AVX-512 has nothing to add until
+// lane groups grow to sixteen.
+KernelFunc float_kernel_for(KernelIsa isa)
+{
+  switch (isa) {
+#ifdef MANDEL_X86_KERNELS
+  case KernelIsa::avx2:
+  case KernelIsa::avx512:
+    return iterate_avx2_float;
+#endif
+  default:
+    return iterate_scalar<float>;
+  }
+}
+
+KernelIsa current_isa = best_isa();
+KernelFunc current_kernel = kernel_for(current_isa);
+KernelFunc current_float_kernel = float_kernel_for(current_isa);
+}
+
+std::uint64_t iterate_lanes(IterateLanes& lanes, unsigned max_steps, LanePrecision precision)
+{
+  return precision == LanePrecision::float32 ? current_float_kernel(lanes, max_steps)
+                                             : current_kernel(lanes, max_steps);
+}
+
+KernelIsa kernel_isa()
+{
+  return current_isa;
+}
+
+void set_kernel_isa(KernelIsa isa)
+{
+  if (!isa_supported(isa)) {
+    isa = (isa == KernelIsa::avx512 && isa_supported(KernelIsa::avx2)) ?
+        KernelIsa::avx2 : KernelIsa::scalar;
+  }
+  current_isa = isa;
+  current_kernel = kernel_for(isa);
+  current_float_kernel = float_kernel_for(isa);
+}
+
+const char* kernel_isa_name(KernelIsa isa)
+{
+  switch (isa) {
+  case KernelIsa::avx2:
+    return "avx2";
+  case KernelIsa::avx512:
+    return "avx512";
+  default:
+    return "scalar";
+  }
+}
+
+const char* lane_precision_name(LanePrecision precision)
+{
+  return precision == LanePrecision::float32 ? "float" : "double";
+}
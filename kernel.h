@@ -0,0 +1,117 @@
+#pragma once
+#include <cstdint>
+
+// Shared by ComplexIterate and the lane kernel so the two cannot drift apart.
+constexpr double escape_value = 10e100;
+
+// Escape threshold on |z|^2 per scalar type. Single precision escapes far
+// earlier so that the next square cannot overflow. Smooth counts are always
+// normalised against escape_value (see adjusted_count), which makes them
+// agree across precisions to well within a palette step.
+template <typename Scalar>
+struct IterateTraits;
+
+template <>
+struct IterateTraits<double> {
+  static constexpr double escape_value = ::escape_value;
+};
+
+template <>
+struct IterateTraits<float> {
+  static constexpr float escape_value = 1e10f;
+};
+
+// Periodicity checking, Brent style: the orbit is compared against a saved
+// reference value, which is replaced after 1, 2, 4, ... iterations. Once the
+// gap between replacements reaches max_period it stops growing, so any cycle
+// of up to max_period iterations is caught within two gaps of the orbit
+// settling. A point counts as bounded when it comes back within tolerance of
+// the reference in both coordinates.
+struct PeriodicityCheck {
+  double tolerance = 0.00000000000001;
+  std::int64_t max_period = 1 << 16;
+};
+
+// Applies to iterates and lanes stepped afterwards. Only change it between
+// passes, never while workers are iterating.
+void set_periodicity_check(const PeriodicityCheck& check);
+const PeriodicityCheck& periodicity_check();
+
+// Smooth iteration count of a point that escaped with |z|^2 = abs_sqr after
+// count iterations.
+float adjusted_count(std::int64_t count, double abs_sqr);
+
+// Analytic interior test: true for points in the main cardioid or the
+// period-2 bulb, which never escape.
+bool in_cardioid_or_bulb(double real, double imag);
+
+// Structure-of-arrays state for a group of points that are iterated together.
+// Each array index is one lane. The kernel below steps every lane that is
+// neither escaped nor bounded with the same arithmetic as
+// ComplexIterate::iterate, so escape counts and smooth counts match it
+// exactly. Finished lanes are masked off and keep their final state.
+struct IterateLanes {
+  static constexpr unsigned width = 8;
+
+  IterateLanes() = default;
+
+  // Starts a lane at c = real + imag i. Points that in_cardioid_or_bulb
+  // proves interior start out bounded and are never stepped.
+  void set(unsigned lane, double real, double imag);
+  // Starts a lane at an offset from the point of a reference orbit, to be
+  // stepped by the perturbation kernel (see perturbation.h). real and imag
+  // then hold the offset dz rather than z.
+  void set_offset(unsigned lane, double real_offset, double imag_offset);
+  // Marks a lane as unused. It counts as finished and is never stepped.
+  void retire(unsigned lane) { bounded_bits |= 1u << lane; }
+
+  bool escaped(unsigned lane) const { return (escaped_bits >> lane) & 1; }
+  bool bounded(unsigned lane) const { return (bounded_bits >> lane) & 1; }
+  bool finished() const { return (escaped_bits | bounded_bits) == all_lanes; }
+
+  // Same meaning as ComplexIterate::getCount.
+  float count(unsigned lane) const
+  {
+    return escaped(lane) ? adjusted_count[lane] : static_cast<float>(iterations[lane]);
+  }
+
+  static constexpr std::uint8_t all_lanes = 0xff;
+
+  double start_real[width];
+  double start_imag[width];
+  double real[width];
+  double imag[width];
+  // Periodicity reference value, and the iteration count at which it is next
+  // replaced.
+  double check_real[width];
+  double check_imag[width];
+  std::int64_t check_at[width];
+  std::int64_t iterations[width];
+  // Perturbed lanes only: the index into the reference orbit of the value
+  // that real and imag are currently offsets from.
+  std::int64_t reference_index[width];
+  float adjusted_count[width];
+  std::uint8_t escaped_bits = 0;
+  std::uint8_t bounded_bits = 0;
+};
+
+enum class KernelIsa { scalar, avx2, avx512 };
+
+// Arithmetic the lanes are stepped in. Lanes always store doubles, which
+// hold single precision values exactly, so a lane keeps the same orbit
+// however it is stored; it must just be stepped in one precision
+// throughout. Single precision packs twice the lanes into a vector register
+// but only resolves points some thousands of ulps apart.
+enum class LanePrecision { float32, float64 };
+
+// Advances every live lane by up to max_steps iterations. Returns the number
+// of lane iterations executed, summed over lanes.
+std::uint64_t iterate_lanes(IterateLanes& lanes, unsigned max_steps,
+                            LanePrecision precision = LanePrecision::float64);
+
+// The kernel is chosen at startup from what the CPU supports. Selecting an
+// instruction set the CPU lacks falls back to the best supported one.
+KernelIsa kernel_isa();
+void set_kernel_isa(KernelIsa isa);
+const char* kernel_isa_name(KernelIsa isa);
+const char* lane_precision_name(LanePrecision precision);
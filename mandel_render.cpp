@@ -0,0 +1,442 @@
+// Headless batch renderer: runs the compute engine to completion and writes
+// the frame to a PPM or PNG file. Needs no display and no GL. Images too big
+// to hold can be rendered in bands of rows, each written out while the next
+// is computed. The render can also be split into tiles across worker
+// processes, local or remote (see TileFarm), in which case this process only
+// colours and writes them.
+#include "BlockingQueue.h"
+#include "engine.h"
+#include "image_writer.h"
+#include "tile_farm.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Options {
+  // Decimal text, so that deep views keep every digit.
+  std::string real_center = "-0.85";
+  std::string imag_center = "0";
+  double width = 2.8;
+  std::uint32_t image_width = 800;
+  std::uint32_t image_height = 800;
+  std::uint64_t iterations = 100000;
+  unsigned threads = 0;
+  unsigned samples = 8;
+  bool region_fill = true;
+  bool mixed_precision = false;
+  unsigned bin_width = 4;
+  bool pin = false;
+  std::string cache;
+  std::string palette;
+  std::string stats;
+  // Rows rendered at a time; 0 renders the image whole.
+  std::uint32_t band_height = 0;
+  // Tile farm: local worker processes, commands that start remote ones,
+  // and whether this process is a worker itself.
+  unsigned processes = 0;
+  std::vector<std::string> workers;
+  std::uint32_t tile_size = 256;
+  bool serve = false;
+  std::string output;
+};
+
+void usage(const char* program)
+{
+  std::cerr
+    << "usage: " << program << " [options] OUTPUT\n"
+    << "       " << program << " --serve [--threads N]\n"
+    << "Renders a view of the Mandelbrot set to OUTPUT (.png, otherwise PPM; - for stdout).\n"
+    << "  --center RE,IM     view centre, to any number of digits (default -0.85,0)\n"
+    << "  --width W          real extent of the view (default 2.8)\n"
+    << "  --size WxH         image size in pixels (default 800x800)\n"
+    << "  --iterations N     iteration cap; later escapes are drawn as interior (default 100000)\n"
+    << "  --threads N        worker threads (default: one per hardware thread)\n"
+    << "  --samples N        sub-samples per anti-aliased pixel, 1 to 16 (default 8)\n"
+    << "  --region-fill B    on or off: fill regions enclosed by interior points (default on)\n"
+    << "  --precision P      auto: single precision for shallow views, or double (default double)\n"
+    << "  --bin-width N      pixels per side of the bins work is scheduled in, 4 or 8 (default 4)\n"
+    << "  --pin B            on or off: pin each worker thread to its own CPU (default off)\n"
+    << "  --cache DIR        read and store finished tiles in DIR\n"
+    << "  --palette P        built-in palette (classic, grey, fire, ocean) or palette file\n"
+    << "  --stats FILE       append engine stats to FILE as JSON lines, once a second\n"
+    << "  --band-height N    render N rows at a time, writing each band out while the next\n"
+    << "                     is computed, so that memory does not grow with the image\n"
+    << "  --processes N      render tiles in N local worker processes\n"
+    << "  --worker CMD       also render tiles in a worker started by the shell command CMD,\n"
+    << "                     such as \"ssh node2 mandel_render --serve\"; may be repeated\n"
+    << "  --tile-size N      pixels per side of the tiles handed to workers (default 256)\n"
+    << "  --serve            be a worker: render the tiles requested on standard input\n";
+}
+
+// Parses argv into options. Returns false on malformed input.
+bool parse(int argc, char* argv[], Options& options)
+{
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    char* end = nullptr;
+
+    if (std::strcmp(arg, "--center") == 0 && value) {
+      const char* comma = std::strchr(value, ',');
+      if (!comma) {
+        return false;
+      }
+      options.real_center.assign(value, comma);
+      options.imag_center = comma + 1;
+    } else if (std::strcmp(arg, "--width") == 0 && value) {
+      options.width = std::strtod(value, &end);
+      if (!(options.width > 0.0)) {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--size") == 0 && value) {
+      options.image_width = std::strtoul(value, &end, 10);
+      if (*end != 'x') {
+        return false;
+      }
+      options.image_height = std::strtoul(end + 1, &end, 10);
+      if (options.image_width == 0 || options.image_height == 0) {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--iterations") == 0 && value) {
+      options.iterations = std::strtoull(value, &end, 10);
+    } else if (std::strcmp(arg, "--threads") == 0 && value) {
+      options.threads = std::strtoul(value, &end, 10);
+    } else if (std::strcmp(arg, "--samples") == 0 && value) {
+      options.samples = std::strtoul(value, &end, 10);
+      if (options.samples < 1 || options.samples > ScreenPixel::subsamples) {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--region-fill") == 0 && value) {
+      if (std::strcmp(value, "on") != 0 && std::strcmp(value, "off") != 0) {
+        return false;
+      }
+      options.region_fill = std::strcmp(value, "on") == 0;
+    } else if (std::strcmp(arg, "--precision") == 0 && value) {
+      if (std::strcmp(value, "auto") != 0 && std::strcmp(value, "double") != 0) {
+        return false;
+      }
+      options.mixed_precision = std::strcmp(value, "auto") == 0;
+    } else if (std::strcmp(arg, "--bin-width") == 0 && value) {
+      options.bin_width = std::strtoul(value, &end, 10);
+    } else if (std::strcmp(arg, "--pin") == 0 && value) {
+      if (std::strcmp(value, "on") != 0 && std::strcmp(value, "off") != 0) {
+        return false;
+      }
+      options.pin = std::strcmp(value, "on") == 0;
+    } else if (std::strcmp(arg, "--cache") == 0 && value) {
+      options.cache = value;
+    } else if (std::strcmp(arg, "--palette") == 0 && value) {
+      options.palette = value;
+    } else if (std::strcmp(arg, "--stats") == 0 && value) {
+      options.stats = value;
+    } else if (std::strcmp(arg, "--band-height") == 0 && value) {
+      options.band_height = std::strtoul(value, &end, 10);
+    } else if (std::strcmp(arg, "--processes") == 0 && value) {
+      options.processes = std::strtoul(value, &end, 10);
+    } else if (std::strcmp(arg, "--worker") == 0 && value) {
+      options.workers.push_back(value);
+    } else if (std::strcmp(arg, "--tile-size") == 0 && value) {
+      options.tile_size = std::strtoul(value, &end, 10);
+      if (options.tile_size == 0) {
+        return false;
+      }
+    } else if (std::strcmp(arg, "--serve") == 0) {
+      options.serve = true;
+      continue;
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      return false;
+    } else if (options.output.empty()) {
+      options.output = arg;
+      continue;
+    } else {
+      return false;
+    }
+
+    // The numeric options must be consumed entirely.
+    if (end && *end != '\0') {
+      return false;
+    }
+    ++i;
+  }
+  return options.serve || !options.output.empty();
+}
+
+// Writes bands of whole rows on a thread of its own, so that the next band
+// is computed while the last is compressed and written. At most one band
+// waits its turn, which bounds memory to the band being computed, the one
+// waiting and the one being written.
+class BandWriter {
+public:
+  explicit BandWriter(std::unique_ptr<ImageWriter> image, std::uint32_t width)
+    : image_(std::move(image))
+    , row_bytes_(std::size_t(width) * 3)
+    , thread_(&BandWriter::run, this)
+  {
+  }
+  ~BandWriter()
+  {
+    if (thread_.joinable()) {
+      bands_.shutdown();
+      thread_.join();
+    }
+  }
+  BandWriter(const BandWriter&) = delete;
+  BandWriter& operator=(const BandWriter&) = delete;
+
+  // Queues a band, waiting while another is already queued.
+  void write(std::vector<std::uint8_t> rows)
+  {
+    bands_.push(std::unique_ptr<std::vector<std::uint8_t>>(
+        new std::vector<std::uint8_t>(std::move(rows))));
+  }
+  // Waits for every band to be written and finishes the image. Throws
+  // whatever writing a band threw.
+  void finish()
+  {
+    bands_.shutdown();
+    thread_.join();
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    image_->finish();
+  }
+
+private:
+  void run()
+  {
+    while (std::unique_ptr<std::vector<std::uint8_t>> rows = bands_.pop()) {
+      // After a failure the bands are still taken, so that write() never
+      // waits for good.
+      if (error_) {
+        continue;
+      }
+      try {
+        image_->write_rows(rows->data(), rows->size() / row_bytes_);
+      } catch (...) {
+        error_ = std::current_exception();
+      }
+    }
+  }
+
+private:
+  std::unique_ptr<ImageWriter> image_;
+  const std::size_t row_bytes_;
+  BlockingQueue<std::vector<std::uint8_t>, 1> bands_;
+  // Only touched by the writing thread until it is joined.
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+
+// Renders in this process, options.band_height rows at a time. Returns
+// false if the options are rejected by the engine.
+bool render_banded(const Options& options, const char* program)
+{
+  const std::uint32_t image_height = options.image_height;
+  const std::uint32_t band_height =
+      options.band_height ? std::min(options.band_height, image_height) : image_height;
+  // Each band takes a row more above and below, where there is one, so that
+  // the pixels on its edges are refined by the same neighbours as in the
+  // whole image. Only the last band can differ in height.
+  auto margin_rows = [&](std::uint32_t top, std::uint32_t rows) {
+    return std::min(top + rows + 1, image_height) - (top ? top - 1 : 0);
+  };
+  std::uint32_t engine_height = margin_rows(0, band_height);
+
+  MandelbrotEngine engine(options.image_width, engine_height, options.threads);
+  engine.set_iteration_cap(options.iterations);
+  engine.set_samples(options.samples);
+  engine.set_region_fill(options.region_fill);
+  engine.set_mixed_precision(options.mixed_precision);
+  if (!engine.set_bin_width(options.bin_width)) {
+    return false;
+  }
+  if (options.pin && !engine.pin_threads()) {
+    std::cerr << program << ": could not pin every worker thread" << std::endl;
+  }
+  if (!options.cache.empty()) {
+    engine.set_tile_cache(options.cache);
+  }
+  if (!options.palette.empty()) {
+    engine.set_palette(Palette::named(options.palette));
+  }
+  // Only a converged band is ever written, so passes can be long.
+  engine.set_frame_time_target(std::chrono::milliseconds(250));
+
+  std::ofstream stats;
+  if (!options.stats.empty()) {
+    stats.open(options.stats, std::ios::app);
+    if (!stats) {
+      throw std::runtime_error("cannot write " + options.stats);
+    }
+  }
+  auto next_dump = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+  // Opened once the view is known to be good, so as not to leave an empty
+  // file behind.
+  std::unique_ptr<BandWriter> writer;
+  const double pixel_width = options.width / options.image_width;
+  const std::size_t row_bytes = std::size_t(options.image_width) * 3;
+  for (std::uint32_t y = 0; y < image_height; y += band_height) {
+    const std::uint32_t rows = std::min(band_height, image_height - y);
+    const std::uint32_t top = y ? y - 1 : 0;
+    if (margin_rows(y, rows) != engine_height) {
+      engine_height = margin_rows(y, rows);
+      engine.resize(options.image_width, engine_height);
+    }
+    // A single band is the whole view, with no offset at all.
+    const double y_offset = top + engine_height / 2.0 - image_height / 2.0;
+    if (!engine.set_view(options.real_center, options.imag_center, options.width, 0.0,
+                         -y_offset * pixel_width)) {
+      return false;
+    }
+    if (!writer) {
+      writer.reset(new BandWriter(
+          ImageWriter::open(options.output, options.image_width, image_height),
+          options.image_width));
+    }
+    while (!engine.converged()) {
+      engine.run_pass();
+      const auto now = std::chrono::steady_clock::now();
+      if (stats.is_open() && now >= next_dump) {
+        engine.stats().write_json(stats);
+        stats.flush();
+        next_dump = now + std::chrono::seconds(1);
+      }
+    }
+
+    const MandelbrotEngine::Frame& frame = engine.frame();
+    const auto first = frame.texture_data.begin() + (y - top) * row_bytes;
+    writer->write(std::vector<std::uint8_t>(first, first + rows * row_bytes));
+  }
+  writer->finish();
+  if (stats.is_open()) {
+    engine.stats().write_json(stats);
+  }
+  return true;
+}
+
+// Renders through a TileFarm, writing each row of tiles once all of its
+// tiles are in. Tiles are handed out row by row, so only the rows being
+// rendered are held.
+void render_farmed(const Options& options, const char* program)
+{
+  FarmView view;
+  view.real_center = options.real_center;
+  view.imag_center = options.imag_center;
+  view.width = options.width;
+  view.image_width = options.image_width;
+  view.image_height = options.image_height;
+  view.iterations = options.iterations;
+  view.samples = options.samples;
+  view.region_fill = options.region_fill;
+  view.mixed_precision = options.mixed_precision;
+  view.bin_width = options.bin_width;
+
+  std::vector<std::string> commands = options.workers;
+  if (options.processes) {
+    char exe[4096];
+    const ssize_t length = readlink("/proc/self/exe", exe, sizeof exe - 1);
+    const std::string path = length > 0 ? std::string(exe, length) : std::string(program);
+    // Local workers share the hardware threads between them.
+    const unsigned threads = options.threads ? options.threads :
+        std::max(std::thread::hardware_concurrency() / options.processes, 1u);
+    for (unsigned i = 0; i < options.processes; ++i) {
+      commands.push_back("'" + path + "' --serve --threads " + std::to_string(threads));
+    }
+  }
+
+  const Palette palette = options.palette.empty() ? Palette::builtins().front()
+                                                  : Palette::named(options.palette);
+  struct TileRow {
+    std::vector<std::uint8_t> rgb;
+    std::uint32_t tiles = 0;
+  };
+  const std::uint32_t tiles_per_row = (view.image_width + options.tile_size - 1) / options.tile_size;
+  std::map<std::uint32_t, TileRow> rows;
+  std::uint32_t next_row = 0;
+
+  TileFarm farm(view, commands, options.tile_size);
+  BandWriter writer(ImageWriter::open(options.output, view.image_width, view.image_height),
+                    view.image_width);
+  farm.render([&](std::uint32_t x, std::uint32_t y, std::uint32_t width, std::uint32_t height,
+                  const float* counts) {
+    TileRow& tile_row = rows[y];
+    tile_row.rgb.resize(std::size_t(view.image_width) * height * 3);
+    for (std::uint32_t row = 0; row < height; ++row) {
+      palette.color(counts + std::size_t(row) * width * view.samples, view.samples, width,
+                    &tile_row.rgb[(std::size_t(row) * view.image_width + x) * 3]);
+    }
+    ++tile_row.tiles;
+
+    for (auto done = rows.find(next_row); done != rows.end() && done->second.tiles == tiles_per_row;
+         done = rows.find(next_row)) {
+      next_row += std::min(options.tile_size, view.image_height - next_row);
+      writer.write(std::move(done->second.rgb));
+      rows.erase(done);
+    }
+  });
+  if (farm.workers_lost()) {
+    std::cerr << program << ": " << farm.workers_lost()
+              << " worker(s) lost; their tiles were rendered by the others" << std::endl;
+  }
+
+  writer.finish();
+}
+}
+
+int main(int argc, char* argv[])
+{
+  Options options;
+  if (!parse(argc, argv, options)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  try {
+    if (options.serve) {
+      serve_tiles(STDIN_FILENO, STDOUT_FILENO, options.threads);
+      return 0;
+    }
+    if (options.processes || !options.workers.empty()) {
+      // Workers run engines of their own, possibly several to a machine,
+      // which would pin their threads to the same CPUs; nothing here has an
+      // engine to cache tiles or report stats; and rows of tiles are
+      // written as they complete anyway.
+      if (options.pin || !options.cache.empty() || !options.stats.empty() ||
+          options.band_height) {
+        std::cerr << argv[0] << ": --pin, --cache, --stats and --band-height do not apply to"
+                  << " tile farm renders" << std::endl;
+        return 1;
+      }
+      if (!MandelbrotEngine::bin_width_supported(options.bin_width)) {
+        usage(argv[0]);
+        return 1;
+      }
+      render_farmed(options, argv[0]);
+      return 0;
+    }
+
+    if (!render_banded(options, argv[0])) {
+      usage(argv[0]);
+      return 1;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,32 +1,8 @@
 #include "mandelbrot.h"
+#include <algorithm>
+#include <bitset>
 #include <cmath>
-
-namespace {
-void colorMap1(bool esc, double iter, float& r, float& g, float& b)
-{
-  if (!esc) {
-    r = 0.0; g = 0.271; b = 0.361;
-    return;
-  }
-
-  const float r_start = 1.0, g_start = 0.4, b_start = 0.2;
-  const float r_end = 0.0, g_end = 0.541, b_end = 0.722;
-
-  const unsigned range = 100;
-
-  if (fmod((iter / range), 2) < 1) {
-    iter = fmod(iter, range);
-  } else {
-    iter = range - fmod(iter, range);
-  }
-
-  auto alpha = iter / static_cast<float>(range);
-
-  r = (1.0 - alpha) * r_start + alpha * r_end;
-  g = (1.0 - alpha) * g_start + alpha * g_end;
-  b = (1.0 - alpha) * b_start + alpha * b_end;
-}
-}
+#include <limits>
 
 void ComplexIterate::iterate()
 {
@@ -35,89 +11,112 @@ void ComplexIterate::iterate()
     auto abs_sqr = _value.real()*_value.real() +
     _value.imag()*_value.imag();
 
-    constexpr double escape_value = 10e100;
     if (abs_sqr > escape_value) {
       _escaped = true;
-      _adjusted_count = _count - log(log(abs_sqr) / log(escape_value)) / log(2.0);
+      _adjusted_count = adjusted_count(_count, abs_sqr);
     } else {
-      constexpr double epsilon = 0.00000000000001;
-      const double real_diff = _value.real() - _slow_value.real();
+      const double tolerance = periodicity_check().tolerance;
+      const double real_diff = _value.real() - _check_value.real();
 
-      if (real_diff < epsilon && real_diff > -epsilon) {
-        const double imag_diff = _value.imag() - _slow_value.imag();
-        if (imag_diff < epsilon && imag_diff > -epsilon) {
+      if (real_diff < tolerance && real_diff > -tolerance) {
+        const double imag_diff = _value.imag() - _check_value.imag();
+        if (imag_diff < tolerance && imag_diff > -tolerance) {
           _bounded = true;
         }
       }
     }
 
-    if (_count > 0 && _count % 2 == 0) {
-      _slow_value = _slow_value * _slow_value + _start;
+    if (_count + 1 == _check_at) {
+      _check_value = _value;
+      _check_at += std::min<std::uint64_t>(_check_at, periodicity_check().max_period);
     }
     ++_count;
   }
 }
 
-Pixel::Pixel(double left, double top, double width)
-: _width(width)
+unsigned ComplexIterate::iterate(unsigned max_steps)
 {
-  // Setup the sub-iterates.
-  const double sub_width = _width / static_cast<double>(subsample_width);
-  const double quarter_width = sub_width / 4.0;
-  const double three_width = sub_width / 2.0 + quarter_width;
-  double x, y;
-  unsigned i, k;
-  unsigned iter = 0;
-
-  for (x = left + quarter_width, i = 0; i < subsample_width; x += sub_width, ++i) {
-    for (y = top - quarter_width, k = 0; k < subsample_width; y -= sub_width, ++k) {
-      new (&_sub_iterates[iter]) ComplexIterate(x, y);
-      ++iter;
-    }
+  unsigned steps = 0;
+  for (; steps < max_steps && !_escaped && !_bounded; ++steps) {
+    iterate();
   }
+  return steps;
+}
 
-  for (x = left + three_width, i = 0; i < subsample_width; x += sub_width, ++i) {
-    for (y = top - three_width, k = 0; k < subsample_width; y -= sub_width, ++k) {
-      new (&_sub_iterates[iter]) ComplexIterate(x, y);
-      ++iter;
+template <typename Pattern>
+Pixel<Pattern>::Pixel(double left, double top, double width, const SeriesApproximation* series,
+                      unsigned first, unsigned last)
+  : _first(first)
+  , _last(last)
+{
+  Pattern::place(left, top, width, [this, series, first, last](unsigned i, double x, double y) {
+    if (i < first || i >= last) {
+      _samples[i / IterateLanes::width].retire(i % IterateLanes::width);
+    } else if (series) {
+      _samples[i / IterateLanes::width].set_offset(i % IterateLanes::width, x, y);
+      series->start_lane(_samples[i / IterateLanes::width], i % IterateLanes::width);
+    } else {
+      _samples[i / IterateLanes::width].set(i % IterateLanes::width, x, y);
     }
+  });
+  for (unsigned i = subsamples; i < lane_groups * IterateLanes::width; ++i) {
+    _samples[i / IterateLanes::width].retire(i % IterateLanes::width);
   }
 }
 
-void Pixel::iterate()
+template <typename Pattern>
+std::uint64_t Pixel<Pattern>::iterate(unsigned budget, const ReferenceOrbit* reference,
+                                      LanePrecision precision)
 {
   if (_final) {
-    return;
+    return 0;
   }
 
-  bool any_live = false;
-  for (unsigned i = 0; i < subsamples; ++i) {
-    _sub_iterates[i].iterate();
-    if (!_sub_iterates[i].escaped() && !_sub_iterates[i].bounded()) {
-      any_live = true;
+  std::uint64_t iterations = 0;
+  bool finished = true;
+  for (IterateLanes& lanes : _samples) {
+    if (lanes.finished()) {
+      continue;
     }
+    iterations += reference ? iterate_lanes(lanes, budget, *reference)
+                            : iterate_lanes(lanes, budget, precision);
+    finished = finished && lanes.finished();
   }
+  _final = finished;
+  return iterations;
+}
 
-  computeColor(_red, _green, _blue);
-  if (!any_live) {
-    _final = true;
+template <typename Pattern>
+unsigned Pixel<Pattern>::finishedSamples() const
+{
+  unsigned finished = 0;
+  for (const IterateLanes& lanes : _samples) {
+    finished += std::bitset<IterateLanes::width>(lanes.escaped_bits | lanes.bounded_bits).count();
   }
+  return finished;
 }
 
-void Pixel::computeColor(unsigned char& r, unsigned char& g, unsigned char& b)
+template <typename Pattern>
+void Pixel<Pattern>::sampleCounts(float* counts) const
 {
-  float r_sum = 0.0, g_sum = 0.0, b_sum = 0.0;
-  for (unsigned i = 0; i < subsamples; ++i) {
-    float red, green, blue;
-    colorMap(_sub_iterates[i].escaped(), _sub_iterates[i].getCount(), red, green, blue);
-    r_sum += red;
-    g_sum += green;
-    b_sum += blue;
+  for (unsigned i = _first; i < _last; ++i) {
+    const IterateLanes& lanes = _samples[i / IterateLanes::width];
+    const unsigned lane = i % IterateLanes::width;
+    if (lanes.escaped(lane)) {
+      counts[i] = lanes.count(lane);
+    } else if (lanes.bounded(lane)) {
+      counts[i] = std::numeric_limits<float>::quiet_NaN();
+    }
   }
+}
 
-  r = r_sum * (255.0 / static_cast<double>(subsamples));
-  g = g_sum * (255.0 / static_cast<double>(subsamples));
-  b = b_sum * (255.0 / static_cast<double>(subsamples));
+template <typename Pattern>
+void Pixel<Pattern>::samplePositions(double* x, double* y)
+{
+  Pattern::place(0.0, 0.0, 1.0, [x, y](unsigned i, double real, double imag) {
+    x[i] = real;
+    y[i] = -imag;
+  });
 }
 
-Pixel::ColorMapFunc Pixel::colorMap = colorMap1;
+template class Pixel<ProgressiveSubsamples<16> >;
@@ -1,5 +1,8 @@
 #pragma once
+#include <cmath>
 #include <complex>
+#include "kernel.h"
+#include "perturbation.h"
 
 class ComplexIterate {
 public:
@@ -10,11 +13,15 @@ public:
   ComplexIterate(const ComplexIterate & c) = default;
 
   ComplexIterate(double r, double i)
-  : _start(r, i), _value(_start), _slow_value(_start)
+  : _start(r, i), _value(_start), _check_value(_start)
   { }
 
   void iterate();
 
+  // Iterates until escaped, bounded, or max_steps iterations have run.
+  // Returns the number of iterations actually run.
+  unsigned iterate(unsigned max_steps);
+
   ValueType getValue() const { return _value; }
 
   float getCount() const
@@ -33,42 +40,91 @@ public:
 private:
   ValueType _start;
   ValueType _value;
-  ValueType _slow_value;
+  // Brent's periodicity check; see PeriodicityCheck.
+  ValueType _check_value;
+  std::uint64_t _check_at = 1;
   bool _escaped = false;
   bool _bounded = false;
   unsigned _count = 0;
   double _adjusted_count;
 };
 
+// Sub-sample layout for Pixel: points of the R2 low-discrepancy sequence,
+// starting at the pixel centre. Every prefix of the sequence covers the pixel
+// evenly, so a pixel can use any number of the first sub-samples. place()
+// calls f(index, real, imag) once per sub-sample of the pixel whose top-left
+// corner is (left, top).
+template <unsigned n>
+struct ProgressiveSubsamples {
+  static constexpr unsigned count = n;
+
+  template <typename F>
+  static void place(double left, double top, double width, F f)
+  {
+    // Reciprocals of the plastic number and of its square.
+    const double step_x = 0.7548776662466927;
+    const double step_y = 0.5698402909980532;
+    for (unsigned i = 0; i < count; ++i) {
+      const double x = 0.5 + i * step_x;
+      const double y = 0.5 + i * step_y;
+      f(i, left + (x - std::floor(x)) * width, top - (y - std::floor(y)) * width);
+    }
+  }
+};
+
+// Iteration state of one screen pixel. Storage is sized exactly to the
+// sub-sample pattern. A pixel holds no colour of its own; callers keep its
+// sampleCounts() and colour those with a Palette, so once a pixel is final its
+// state can be discarded and the counts alone represent it.
+template <typename Pattern>
 class Pixel
 {
 public:
-  typedef void (*ColorMapFunc)(bool, double, float&, float&, float&);
+  static constexpr unsigned subsamples = Pattern::count;
 
 public:
   Pixel() = default;
-  Pixel(double left, double top, double width);
-
-  void iterate();
+  // With a series approximation, left and top are offsets from the point of
+  // its reference orbit, sub-samples start where the series leaves off, and
+  // the pixel must always be iterated against that orbit. Only sub-samples
+  // first up to (not including) last are iterated; the caller already knows
+  // or does not want the others.
+  Pixel(double left, double top, double width, const SeriesApproximation* series = nullptr,
+        unsigned first = 0, unsigned last = subsamples);
+
+  // Advances every sub-sample by up to budget iterations. Returns the number
+  // of sub-sample iterations run. A pixel must be iterated in the same
+  // precision throughout; perturbed pixels are always in double.
+  std::uint64_t iterate(unsigned budget = 1, const ReferenceOrbit* reference = nullptr,
+                        LanePrecision precision = LanePrecision::float64);
 
   bool isFinal() const { return _final; }
-
-  void color(unsigned char& r, unsigned char& g, unsigned char& b)
-  { r = _red; g = _green; b = _blue; }
-
-  void computeColor(unsigned char& r, unsigned char& g, unsigned char& b);
+  // Number of sub-samples that have escaped or been found bounded. The
+  // counts only change when this does.
+  unsigned finishedSamples() const;
+
+  // Writes the smooth count of every iterated sub-sample that escaped, or
+  // NaN for one found bounded, at its index in counts. Entries of the other
+  // sub-samples are left alone. Together with the palette this is all a
+  // pixel's colour depends on.
+  void sampleCounts(float* counts) const;
+  // Positions of the sub-samples within a pixel of width 1, measured right
+  // and down from its top-left corner.
+  static void samplePositions(double* x, double* y);
 
 private:
-  static ColorMapFunc colorMap;
-  static constexpr unsigned subsample_width = 2;
-  static constexpr unsigned subsamples = 2 * subsample_width * subsample_width;
+  static constexpr unsigned lane_groups =
+      (subsamples + IterateLanes::width - 1) / IterateLanes::width;
 
 private:
   bool _final = false;
-  // Subsampling for smoothness.
-  ComplexIterate _sub_iterates[32];
-  double _width;
-  unsigned char _red;
-  unsigned char _green;
-  unsigned char _blue;
+  std::uint8_t _first = 0;
+  std::uint8_t _last = 0;
+  // Subsampling for smoothness, iterated together by the lane kernel. Lanes
+  // past the end of the pattern are retired at construction.
+  IterateLanes _samples[lane_groups];
 };
+
+// The pattern the application renders with. Sub-sample 0 is the pixel
+// centre, which the engine iterates on its own first.
+typedef Pixel<ProgressiveSubsamples<16> > ScreenPixel;
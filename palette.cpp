@@ -0,0 +1,267 @@
+#include "palette.h"
+#include "kernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MANDEL_X86_PALETTE 1
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr unsigned lanes = 8;
+
+// Sums the eight lane totals pairwise, in the order the vector code adds its
+// register halves, so both paths round identically.
+float sum_lanes(const float* total)
+{
+  const float quarter[4] = { total[0] + total[4], total[1] + total[5],
+                             total[2] + total[6], total[3] + total[7] };
+  const float half[2] = { quarter[0] + quarter[2], quarter[1] + quarter[3] };
+  return half[0] + half[1];
+}
+
+std::uint8_t to_byte(float sum, unsigned samples)
+{
+  return static_cast<std::uint8_t>(sum * (255.0 / static_cast<double>(samples)));
+}
+
+// Shortest period a palette may have. Counts never exceed 2^64, so counts
+// times the reciprocal stay finite in float.
+constexpr double min_period = 1e-3;
+
+float checked_inverse_period(const std::string& name, double period)
+{
+  if (!(period >= min_period) || !std::isfinite(period)) {
+    throw std::runtime_error("palette " + name + " needs a finite period of at least 0.001");
+  }
+  return static_cast<float>(1.0 / period);
+}
+
+// Whether a palette file colour component is in 0..255.
+bool is_component(double value)
+{
+  return value >= 0.0 && value <= 255.0;
+}
+
+Palette::Color to_color(double r, double g, double b)
+{
+  return { static_cast<float>(r / 255.0), static_cast<float>(g / 255.0),
+           static_cast<float>(b / 255.0) };
+}
+
+#ifdef MANDEL_X86_PALETTE
+__attribute__((target("avx2")))
+float sum_lanes(__m256 total)
+{
+  const __m128 quarter = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+  const __m128 half = _mm_add_ps(quarter, _mm_movehl_ps(quarter, quarter));
+  return _mm_cvtss_f32(_mm_add_ss(half, _mm_shuffle_ps(half, half, 1)));
+}
+#endif
+}
+
+Palette::Palette(std::string name, double period, std::vector<Stop> stops, Color interior)
+  : name_(std::move(name))
+  , inverse_period_(checked_inverse_period(name_, period))
+  , interior_(interior)
+{
+  if (stops.empty()) {
+    throw std::runtime_error("palette " + name_ + " needs a stop");
+  }
+  for (Stop& stop : stops) {
+    stop.position -= std::floor(stop.position);
+  }
+  std::sort(stops.begin(), stops.end(),
+            [](const Stop& a, const Stop& b) { return a.position < b.position; });
+
+  std::vector<Color> table(table_size_);
+  std::size_t next = 0;
+  for (unsigned k = 0; k < table_size_; ++k) {
+    const double t = static_cast<double>(k) / table_size_;
+    while (next < stops.size() && stops[next].position <= t) {
+      ++next;
+    }
+    // The stops on either side of t, wrapping around the end of the period.
+    const Stop& before = stops[(next + stops.size() - 1) % stops.size()];
+    const Stop& after = stops[next % stops.size()];
+    const double from = before.position - (next == 0 ? 1.0 : 0.0);
+    const double to = after.position + (next == stops.size() ? 1.0 : 0.0);
+    const double alpha = to > from ? (t - from) / (to - from) : 0.0;
+    table[k].r = static_cast<float>((1.0 - alpha) * before.color.r + alpha * after.color.r);
+    table[k].g = static_cast<float>((1.0 - alpha) * before.color.g + alpha * after.color.g);
+    table[k].b = static_cast<float>((1.0 - alpha) * before.color.b + alpha * after.color.b);
+  }
+
+  for (unsigned c = 0; c < 3; ++c) {
+    value_[c].resize(table_size_);
+    delta_[c].resize(table_size_);
+  }
+  for (unsigned k = 0; k < table_size_; ++k) {
+    const Color& here = table[k];
+    const Color& there = table[(k + 1) % table_size_];
+    value_[0][k] = here.r;
+    value_[1][k] = here.g;
+    value_[2][k] = here.b;
+    delta_[0][k] = there.r - here.r;
+    delta_[1][k] = there.g - here.g;
+    delta_[2][k] = there.b - here.b;
+  }
+}
+
+Palette Palette::load(const std::string& path)
+{
+  std::ifstream in(path);
+  if (!in) {
+    throw std::runtime_error("cannot open palette " + path);
+  }
+
+  double period = 0.0;
+  Color interior = { 0.0f, 0.0f, 0.0f };
+  std::vector<Stop> stops;
+  std::string line;
+  for (unsigned number = 1; std::getline(in, line); ++number) {
+    std::istringstream fields(line.substr(0, line.find('#')));
+    std::string directive;
+    if (!(fields >> directive)) {
+      continue;
+    }
+    double position = 0.0, r = 0.0, g = 0.0, b = 0.0;
+    bool ok;
+    if (directive == "period") {
+      ok = static_cast<bool>(fields >> period);
+    } else if (directive == "interior") {
+      ok = fields >> r >> g >> b && is_component(r) && is_component(g) && is_component(b);
+      if (ok) {
+        interior = to_color(r, g, b);
+      }
+    } else if (directive == "stop") {
+      ok = fields >> position >> r >> g >> b && is_component(r) && is_component(g) &&
+           is_component(b);
+      if (ok) {
+        stops.push_back({ position, to_color(r, g, b) });
+      }
+    } else {
+      ok = false;
+    }
+    std::string rest;
+    if (!ok || fields >> rest) {
+      throw std::runtime_error(path + ":" + std::to_string(number) + ": malformed palette line");
+    }
+  }
+  return Palette(path, period, std::move(stops), interior);
+}
+
+const std::vector<Palette>& Palette::builtins()
+{
+  static const std::vector<Palette> palettes = {
+    // Orange to blue and back every 200 iterations.
+    Palette("classic", 200.0, { { 0.0, { 1.0f, 0.4f, 0.2f } }, { 0.5, { 0.0f, 0.541f, 0.722f } } },
+            { 0.0f, 0.271f, 0.361f }),
+    Palette("grey", 128.0, { { 0.0, { 0.0f, 0.0f, 0.0f } }, { 0.5, { 1.0f, 1.0f, 1.0f } } },
+            { 0.0f, 0.0f, 0.0f }),
+    Palette("fire", 256.0, { { 0.0, { 0.0f, 0.0f, 0.0f } }, { 0.25, { 0.8f, 0.1f, 0.0f } },
+                             { 0.5, { 1.0f, 0.8f, 0.1f } }, { 0.75, { 1.0f, 1.0f, 0.9f } } },
+            { 0.0f, 0.0f, 0.0f }),
+    Palette("ocean", 300.0, { { 0.0, { 0.0f, 0.03f, 0.2f } }, { 0.33, { 0.0f, 0.5f, 0.7f } },
+                              { 0.66, { 0.9f, 0.95f, 1.0f } } },
+            { 0.0f, 0.0f, 0.0f }),
+  };
+  return palettes;
+}
+
+Palette Palette::named(const std::string& name_or_path)
+{
+  for (const Palette& palette : builtins()) {
+    if (palette.name() == name_or_path) {
+      return palette;
+    }
+  }
+  return load(name_or_path);
+}
+
+void Palette::color(const float* counts, unsigned samples, std::size_t count,
+                    std::uint8_t* rgb) const
+{
+  constexpr unsigned mask = table_size_ - 1;
+  const float scale = static_cast<float>(table_size_);
+  std::size_t pixel = 0;
+
+#ifdef MANDEL_X86_PALETTE
+  // Eight sub-samples per register: three gathers for the table values,
+  // three for the differences, and a blend for the interior.
+  if (samples % lanes == 0 && kernel_isa() != KernelIsa::scalar) {
+    pixel = color_avx2(counts, samples, count, rgb);
+  }
+#endif
+
+  for (; pixel < count; ++pixel) {
+    const float* sample = counts + pixel * samples;
+    float total[3][lanes] = {};
+    for (unsigned i = 0; i < samples; ++i) {
+      const float c = sample[i];
+      if (c != c) {
+        total[0][i % lanes] += interior_.r;
+        total[1][i % lanes] += interior_.g;
+        total[2][i % lanes] += interior_.b;
+        continue;
+      }
+      float q = c * inverse_period_;
+      q = q - std::floor(q);
+      const float p = q * scale;
+      const int step = static_cast<int>(p);
+      const float fraction = p - static_cast<float>(step);
+      const unsigned k = static_cast<unsigned>(step) & mask;
+      for (unsigned channel = 0; channel < 3; ++channel) {
+        total[channel][i % lanes] += value_[channel][k] + fraction * delta_[channel][k];
+      }
+    }
+    for (unsigned channel = 0; channel < 3; ++channel) {
+      rgb[pixel * 3 + channel] = to_byte(sum_lanes(total[channel]), samples);
+    }
+  }
+}
+
+#ifdef MANDEL_X86_PALETTE
+__attribute__((target("avx2")))
+std::size_t Palette::color_avx2(const float* counts, unsigned samples, std::size_t count,
+                                std::uint8_t* rgb) const
+{
+  const __m256 inverse_period = _mm256_set1_ps(inverse_period_);
+  const __m256 scale = _mm256_set1_ps(static_cast<float>(table_size_));
+  const __m256i mask = _mm256_set1_epi32(table_size_ - 1);
+  const __m256 interior[3] = { _mm256_set1_ps(interior_.r), _mm256_set1_ps(interior_.g),
+                               _mm256_set1_ps(interior_.b) };
+
+  for (std::size_t pixel = 0; pixel < count; ++pixel) {
+    __m256 total[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+    for (unsigned i = 0; i < samples; i += lanes) {
+      const __m256 c = _mm256_loadu_ps(counts + pixel * samples + i);
+      const __m256 escaped = _mm256_cmp_ps(c, c, _CMP_ORD_Q);
+      __m256 q = _mm256_mul_ps(c, inverse_period);
+      q = _mm256_sub_ps(q, _mm256_floor_ps(q));
+      const __m256 p = _mm256_mul_ps(q, scale);
+      // NaN converts to INT_MIN, which the mask turns into a safe index.
+      const __m256i step = _mm256_cvttps_epi32(p);
+      const __m256 fraction = _mm256_sub_ps(p, _mm256_cvtepi32_ps(step));
+      const __m256i k = _mm256_and_si256(step, mask);
+      for (unsigned channel = 0; channel < 3; ++channel) {
+        const __m256 value = _mm256_i32gather_ps(value_[channel].data(), k, 4);
+        const __m256 delta = _mm256_i32gather_ps(delta_[channel].data(), k, 4);
+        const __m256 color = _mm256_add_ps(value, _mm256_mul_ps(fraction, delta));
+        total[channel] = _mm256_add_ps(total[channel],
+                                       _mm256_blendv_ps(interior[channel], color, escaped));
+      }
+    }
+    for (unsigned channel = 0; channel < 3; ++channel) {
+      rgb[pixel * 3 + channel] = to_byte(sum_lanes(total[channel]), samples);
+    }
+  }
+  return count;
+}
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A colour gradient that repeats every period iterations, sampled into a
+// lookup table so that colouring a sub-sample costs a table read and one
+// linear interpolation. Escaped sub-samples are coloured by their smooth
+// count; the rest (NaN counts, see Pixel::sampleCounts) get the interior
+// colour.
+//
+// Palettes come built in (see builtins()) or from a text file, one
+// directive per line; components run from 0 to 255 and # starts a comment:
+//
+//   period 200          iterations per cycle of the gradient, at least 0.001
+//   interior 0 69 92    colour of points that do not escape
+//   stop 0 255 102 51   colour at a fraction of the period, from 0 up to 1;
+//   stop 0.5 0 138 184  the gradient wraps from the last stop to the first
+class Palette {
+public:
+  struct Color {
+    float r, g, b;
+  };
+  struct Stop {
+    double position;
+    Color color;
+  };
+
+  // Stops may come in any order; there must be at least one. Components are
+  // in [0, 1].
+  Palette(std::string name, double period, std::vector<Stop> stops, Color interior);
+
+  // Parses a palette file and names it after the path. Throws
+  // std::runtime_error if it cannot be read or is malformed.
+  static Palette load(const std::string& path);
+  // The built-in palettes; the first is the default.
+  static const std::vector<Palette>& builtins();
+  // A built-in palette by name, or a palette file by path.
+  static Palette named(const std::string& name_or_path);
+
+  const std::string& name() const { return name_; }
+
+  // Colours count pixels of samples sub-samples each, reading their counts
+  // one pixel after another and writing count RGB triples. Each pixel is
+  // the average colour of its sub-samples.
+  void color(const float* counts, unsigned samples, std::size_t count, std::uint8_t* rgb) const;
+
+private:
+  // The vector path of color() on x86; returns how many pixels it coloured.
+  std::size_t color_avx2(const float* counts, unsigned samples, std::size_t count,
+                         std::uint8_t* rgb) const;
+
+private:
+  static constexpr unsigned table_size_ = 1024;
+  static_assert((table_size_ & (table_size_ - 1)) == 0, "table size is a power of two");
+
+  std::string name_;
+  float inverse_period_;
+  Color interior_;
+  // Per channel, the gradient at table_size_ even steps through the period
+  // and the difference to the next step, which interpolation scales.
+  std::vector<float> value_[3];
+  std::vector<float> delta_[3];
+};
@@ -0,0 +1,304 @@
+#include "perturbation.h"
+
+#include <gmp.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+struct ReferenceOrbit::State {
+  mpf_t point_real, point_imag;
+  // The last value of the orbit, from which extend() carries on.
+  mpf_t z_real, z_imag;
+  mpf_t real_sqr, imag_sqr, cross;
+
+  State()
+  {
+    mpf_inits(point_real, point_imag, z_real, z_imag, real_sqr, imag_sqr, cross, nullptr);
+  }
+  ~State()
+  {
+    mpf_clears(point_real, point_imag, z_real, z_imag, real_sqr, imag_sqr, cross, nullptr);
+  }
+  State(const State&) = delete;
+  State& operator=(const State&) = delete;
+};
+
+namespace {
+std::string to_text(const mpf_t value, int digits)
+{
+  // By default, enough decimal digits to round-trip every bit of the
+  // mantissa.
+  if (digits <= 0) {
+    digits = static_cast<int>(mpf_get_prec(value) * 0.30103) + 2;
+  }
+  std::vector<char> text(digits + 32);
+  gmp_snprintf(text.data(), text.size(), "%.*Fg", digits, value);
+  return text.data();
+}
+}
+
+ReferenceOrbit::ReferenceOrbit()
+  : state_(new State)
+{
+  set_precision(64);
+}
+
+ReferenceOrbit::~ReferenceOrbit() = default;
+
+void ReferenceOrbit::set_point(double real, double imag)
+{
+  mpf_set_d(state_->point_real, real);
+  mpf_set_d(state_->point_imag, imag);
+  this->point_changed();
+}
+
+bool ReferenceOrbit::set_point(const std::string& real, const std::string& imag)
+{
+  mpf_t parsed_real, parsed_imag;
+  mpf_init2(parsed_real, precision());
+  mpf_init2(parsed_imag, precision());
+  const bool ok = mpf_set_str(parsed_real, real.c_str(), 10) == 0 &&
+                  mpf_set_str(parsed_imag, imag.c_str(), 10) == 0;
+  if (ok) {
+    mpf_set(state_->point_real, parsed_real);
+    mpf_set(state_->point_imag, parsed_imag);
+    this->point_changed();
+  }
+  mpf_clears(parsed_real, parsed_imag, nullptr);
+  return ok;
+}
+
+void ReferenceOrbit::offset_point(double real, double imag)
+{
+  mpf_set_d(state_->cross, real);
+  mpf_add(state_->point_real, state_->point_real, state_->cross);
+  mpf_set_d(state_->cross, imag);
+  mpf_add(state_->point_imag, state_->point_imag, state_->cross);
+  this->point_changed();
+}
+
+void ReferenceOrbit::set_precision(unsigned bits)
+{
+  State& s = *state_;
+  for (mpf_ptr value : { s.point_real, s.point_imag, s.z_real, s.z_imag,
+                         s.real_sqr, s.imag_sqr, s.cross }) {
+    mpf_set_prec(value, bits);
+  }
+  this->point_changed();
+}
+
+unsigned ReferenceOrbit::precision() const
+{
+  return mpf_get_prec(state_->point_real);
+}
+
+std::string ReferenceOrbit::real_text(int digits) const
+{
+  return to_text(state_->point_real, digits);
+}
+
+std::string ReferenceOrbit::imag_text(int digits) const
+{
+  return to_text(state_->point_imag, digits);
+}
+
+void ReferenceOrbit::point_changed()
+{
+  real_ = std::strtod(real_text().c_str(), nullptr);
+  imag_ = std::strtod(imag_text().c_str(), nullptr);
+  this->clear();
+}
+
+void ReferenceOrbit::clear()
+{
+  escaped_ = false;
+  orbit_real_.clear();
+  orbit_imag_.clear();
+}
+
+void ReferenceOrbit::extend(std::size_t length)
+{
+  State& s = *state_;
+  if (orbit_real_.empty() && length > 0) {
+    mpf_set_ui(s.z_real, 0);
+    mpf_set_ui(s.z_imag, 0);
+    orbit_real_.push_back(0.0);
+    orbit_imag_.push_back(0.0);
+  }
+
+  orbit_real_.reserve(length);
+  orbit_imag_.reserve(length);
+  while (!escaped_ && orbit_real_.size() < length) {
+    mpf_mul(s.real_sqr, s.z_real, s.z_real);
+    mpf_mul(s.imag_sqr, s.z_imag, s.z_imag);
+    mpf_mul(s.cross, s.z_real, s.z_imag);
+    mpf_sub(s.z_real, s.real_sqr, s.imag_sqr);
+    mpf_add(s.z_real, s.z_real, s.point_real);
+    mpf_mul_2exp(s.cross, s.cross, 1);
+    mpf_add(s.z_imag, s.cross, s.point_imag);
+
+    const double real = mpf_get_d(s.z_real);
+    const double imag = mpf_get_d(s.z_imag);
+    orbit_real_.push_back(real);
+    orbit_imag_.push_back(imag);
+    // Past the escape radius the lanes themselves escape, so the orbit is
+    // never needed beyond it.
+    escaped_ = real * real + imag * imag > escape_value;
+  }
+}
+
+void SeriesApproximation::compute(ReferenceOrbit& reference, double max_offset,
+                                  double pixel_spacing, std::uint64_t max_iterations)
+{
+  index_ = 1;
+  a_ = 1.0;
+  b_ = c_ = 0.0;
+
+  const double r = max_offset;
+  const double r2 = r * r, r3 = r2 * r, r4 = r2 * r2, r5 = r4 * r, r6 = r3 * r3;
+  // Bound on |dz - (A dc + B dc^2 + C dc^3)| over every |dc| <= r.
+  double remainder = 0.0;
+  // The orbit is extended in blocks; each block costs a few arbitrary
+  // precision operations per iteration.
+  constexpr std::size_t block = 1024;
+  while (index_ <= max_iterations) {
+    if (index_ + 1 >= reference.size()) {
+      if (reference.escaped()) {
+        break;
+      }
+      reference.extend(reference.size() + block);
+      continue;
+    }
+
+    const Coefficient z(reference.orbit_real()[index_], reference.orbit_imag()[index_]);
+    const Coefficient a = 2.0 * z * a_ + 1.0;
+    const Coefficient b = 2.0 * z * b_ + a_ * a_;
+    const Coefficient c = 2.0 * z * c_ + 2.0 * a_ * b_;
+
+    // Writing dz = P + R, with P the cubic, one step gives
+    //   R' = 2 Z R + 2 P R + R^2 + (the terms of P^2 of degree four to six),
+    // the last being what the new coefficients leave out.
+    const double polynomial = std::abs(a_) * r + std::abs(b_) * r2 + std::abs(c_) * r3;
+    const double dropped = std::abs(b_ * b_ + 2.0 * a_ * c_) * r4 +
+                           2.0 * std::abs(b_ * c_) * r5 + std::norm(c_) * r6;
+    const double next_remainder =
+        (2.0 * std::abs(z) + 2.0 * polynomial + remainder) * remainder + dropped;
+    // Neighbouring pixels' offsets are at least this far apart: the least
+    // derivative of the cubic over the disc, times the pixel spacing.
+    const double separation =
+        (std::abs(a) - 2.0 * std::abs(b) * r - 3.0 * std::abs(c) * r2) * pixel_spacing;
+    // No point of the disc may escape within the skipped iterations.
+    const Coefficient next_z(reference.orbit_real()[index_ + 1], reference.orbit_imag()[index_ + 1]);
+    const double reach = std::abs(next_z) + std::abs(a) * r + std::abs(b) * r2 +
+                         std::abs(c) * r3 + next_remainder;
+    if (!(next_remainder < tolerance_ * separation) || !(reach < 2.0)) {
+      break;
+    }
+    a_ = a;
+    b_ = b;
+    c_ = c;
+    remainder = next_remainder;
+    ++index_;
+  }
+}
+
+void SeriesApproximation::start_lane(IterateLanes& l, unsigned lane) const
+{
+  if (index_ == 1) {
+    return;
+  }
+  const Coefficient dc(l.start_real[lane], l.start_imag[lane]);
+  const Coefficient dz = ((c_ * dc + b_) * dc + a_) * dc;
+  l.real[lane] = dz.real();
+  l.imag[lane] = dz.imag();
+  l.reference_index[lane] = index_;
+  l.iterations[lane] = index_ - 1;
+  // Replaced on the first step.
+  l.check_at[lane] = index_;
+}
+
+std::uint64_t iterate_lanes(IterateLanes& l, unsigned max_steps,
+                            const ReferenceOrbit& reference)
+{
+  const double* orbit_real = reference.orbit_real();
+  const double* orbit_imag = reference.orbit_imag();
+  // An orbit that has not escaped is long enough for every step of this call.
+  const std::int64_t last = reference.escaped() ?
+      static_cast<std::int64_t>(reference.size()) - 1 : std::numeric_limits<std::int64_t>::max();
+  const double tolerance = reference.periodicity_tolerance();
+  const std::int64_t max_period = periodicity_check().max_period;
+
+  std::uint64_t total = 0;
+  for (unsigned lane = 0; lane < IterateLanes::width; ++lane) {
+    if (l.escaped(lane) || l.bounded(lane)) {
+      continue;
+    }
+    const double sr = l.start_real[lane], si = l.start_imag[lane];
+    double dr = l.real[lane], di = l.imag[lane];
+    double cr = l.check_real[lane], ci = l.check_imag[lane];
+    std::int64_t check_at = l.check_at[lane];
+    std::int64_t count = l.iterations[lane];
+    std::int64_t index = l.reference_index[lane];
+
+    for (unsigned step = 0; step < max_steps; ++step) {
+      if (index == last) {
+        dr += orbit_real[index];
+        di += orbit_imag[index];
+        index = 0;
+      }
+
+      const double zr = orbit_real[index], zi = orbit_imag[index];
+      const double ndr = 2.0 * (zr * dr - zi * di) + (dr * dr - di * di) + sr;
+      const double ndi = 2.0 * (zr * di + zi * dr) + 2.0 * dr * di + si;
+      ++index;
+      const double re = orbit_real[index] + ndr;
+      const double im = orbit_imag[index] + ndi;
+      const double abs_sqr = re * re + im * im;
+
+      bool done = false;
+      if (abs_sqr > escape_value) {
+        l.escaped_bits |= 1u << lane;
+        l.adjusted_count[lane] = adjusted_count(count, abs_sqr);
+        done = true;
+      } else {
+        const double real_diff = re - cr;
+        const double imag_diff = im - ci;
+        if (real_diff < tolerance && real_diff > -tolerance &&
+            imag_diff < tolerance && imag_diff > -tolerance) {
+          l.bounded_bits |= 1u << lane;
+          done = true;
+        }
+      }
+
+      if (count + 1 == check_at) {
+        cr = re;
+        ci = im;
+        check_at += std::min(check_at, max_period);
+      }
+      ++count;
+
+      if (abs_sqr < ndr * ndr + ndi * ndi) {
+        dr = re;
+        di = im;
+        index = 0;
+      } else {
+        dr = ndr;
+        di = ndi;
+      }
+      if (done) {
+        break;
+      }
+    }
+
+    total += count - l.iterations[lane];
+    l.real[lane] = dr;
+    l.imag[lane] = di;
+    l.check_real[lane] = cr;
+    l.check_imag[lane] = ci;
+    l.check_at[lane] = check_at;
+    l.iterations[lane] = count;
+    l.reference_index[lane] = index;
+  }
+  return total;
+}
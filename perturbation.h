@@ -0,0 +1,131 @@
+#pragma once
+#include "kernel.h"
+
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Deep zoom by perturbation. One reference point C, held to arbitrary
+// precision, is iterated exactly; its orbit Z is then rounded to double. Every
+// other point c = C + dc is iterated as the offset dz of its orbit from Z:
+//
+//   dz' = 2 Z dz + dz^2 + dc
+//
+// dz and dc are tiny but keep full double precision, so views can be far
+// narrower than a double can resolve. The arbitrary precision arithmetic is
+// GMP, and only perturbation.cpp depends on it.
+class ReferenceOrbit {
+public:
+  ReferenceOrbit();
+  ~ReferenceOrbit();
+  ReferenceOrbit(const ReferenceOrbit&) = delete;
+  ReferenceOrbit& operator=(const ReferenceOrbit&) = delete;
+
+  // Moves the reference point and discards the orbit. The text form takes
+  // decimal numbers such as "-1.25e-3" and returns false if either does not
+  // parse, leaving the point unchanged.
+  void set_point(double real, double imag);
+  bool set_point(const std::string& real, const std::string& imag);
+  // Moves the reference point by a small offset and discards the orbit.
+  void offset_point(double real, double imag);
+  // Precision in bits of the point and of the orbit computation. Raise it
+  // before offsetting the point by less than the current precision resolves.
+  void set_precision(unsigned bits);
+  unsigned precision() const;
+
+  double real() const { return real_; }
+  double imag() const { return imag_; }
+  // The point in decimal, with as many significant digits as the precision
+  // carries, or the given number of them.
+  std::string real_text(int digits = 0) const;
+  std::string imag_text(int digits = 0) const;
+
+  // Iterates the reference point until the orbit holds at least length
+  // values (Z_0 = 0 through Z_length-1) or the point escapes.
+  void extend(std::size_t length);
+  void clear();
+  std::size_t size() const { return orbit_real_.size(); }
+  // True once the orbit is complete because the reference point escaped.
+  bool escaped() const { return escaped_; }
+  const double* orbit_real() const { return orbit_real_.data(); }
+  const double* orbit_imag() const { return orbit_imag_.data(); }
+
+  // Periodicity tolerance for perturbed lanes. Neighbouring points follow the
+  // same orbit closely for a long time, so at deep zooms the tolerance has to
+  // shrink with the pixel spacing or exterior points pass for cycles.
+  void set_periodicity_tolerance(double tolerance) { periodicity_tolerance_ = tolerance; }
+  double periodicity_tolerance() const { return periodicity_tolerance_; }
+
+private:
+  struct State;
+  // Reads the point back into real_ and imag_ after it changes.
+  void point_changed();
+
+  std::unique_ptr<State> state_;
+  // The point rounded to nearest; GMP's own conversion truncates.
+  double real_ = 0.0;
+  double imag_ = 0.0;
+  bool escaped_ = false;
+  double periodicity_tolerance_ = 0.0;
+  std::vector<double> orbit_real_;
+  std::vector<double> orbit_imag_;
+};
+
+// Series approximation: for small dc the offset after n iterations is close
+// to a polynomial in dc,
+//
+//   dz_n = A_n dc + B_n dc^2 + C_n dc^3,
+//
+// whose coefficients follow from the reference orbit alone:
+//
+//   A_n+1 = 2 Z_n A_n + 1,  B_n+1 = 2 Z_n B_n + A_n^2,  C_n+1 = 2 Z_n C_n + 2 A_n B_n
+//
+// Every pixel of a deep view follows nearly the same path for its first
+// thousands of iterations, so evaluating the polynomial once per sub-sample
+// replaces all of those iterations.
+class SeriesApproximation {
+public:
+  // Advances the coefficients along the reference orbit, extending it as
+  // needed, for as long as the approximation stays exact to within a tiny
+  // fraction of the distance between neighbouring pixels' offsets, and no
+  // point within max_offset of the reference can have escaped. The error is
+  // bounded rather than estimated: a bound on everything the cubic leaves out
+  // is carried along with the coefficients. Never skips past iteration
+  // max_iterations.
+  void compute(ReferenceOrbit& reference, double max_offset, double pixel_spacing,
+               std::uint64_t max_iterations);
+  // Number of iterations every sub-sample starts with. Zero skips nothing.
+  std::uint64_t skipped() const { return index_ - 1; }
+
+  // Moves a lane freshly set up with IterateLanes::set_offset forward to the
+  // end of the approximation.
+  void start_lane(IterateLanes& lanes, unsigned lane) const;
+
+private:
+  // Fraction of the neighbouring-pixel distance the error may reach. Deep
+  // views have pixels whose counts change by hundreds of iterations within a
+  // millionth of a pixel, so it must be tiny.
+  static constexpr double tolerance_ = 1e-10;
+
+  typedef std::complex<double> Coefficient;
+  // The coefficients for dz at this index into the reference orbit.
+  std::uint64_t index_ = 1;
+  Coefficient a_{1.0};
+  Coefficient b_{};
+  Coefficient c_{};
+};
+
+// Steps every live lane of a group set up with IterateLanes::set_offset by up
+// to max_steps iterations against the reference orbit. The orbit must hold at
+// least the lanes' iteration count plus max_steps plus two values unless it
+// escaped. Returns the number of lane iterations run.
+//
+// Whenever the full value Z + dz becomes smaller than dz, the offset has lost
+// its precision relative to the reference (a glitch). The lane then rebases:
+// it continues from dz = Z + dz against Z_0 = 0, which is exact, so glitches
+// are corrected as they happen rather than patched afterwards. Lanes also
+// rebase when they run past the end of an escaped reference.
+std::uint64_t iterate_lanes(IterateLanes& lanes, unsigned max_steps,
+                            const ReferenceOrbit& reference);
@@ -1,3 +1,7 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <GL/glut.h>
 #include "app.h"
@@ -7,12 +11,27 @@ using GlutWindow = int;
 GlutWindow main_window;
 GlutWindow iterates_window;
 std::unique_ptr<MandelbrotApp> app;
+// Where MANDEL_STATS asks for the stats to go, once a second.
+std::ofstream stats_log;
+std::chrono::steady_clock::time_point next_stats_dump;
 }
 
-void idleFunc()
+// Frames are computed on a background thread; the GLUT thread only checks
+// for new ones, so input is handled promptly however long a pass takes.
+constexpr unsigned frame_poll_ms = 10;
+
+void pollFrames(int)
 {
-  app->main_loop();
-  glutPostWindowRedisplay(main_window);
+  if (app->frame_ready()) {
+    glutPostWindowRedisplay(main_window);
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (stats_log.is_open() && now >= next_stats_dump) {
+    app->stats().write_json(stats_log);
+    stats_log.flush();
+    next_stats_dump = now + std::chrono::seconds(1);
+  }
+  glutTimerFunc(frame_poll_ms, pollFrames, 0);
 }
 
 void mouseHandler(int button, int state, int x, int y)
@@ -40,6 +59,57 @@ void mouseHandler(int button, int state, int x, int y)
   }
 }
 
+void motionHandler(int x, int y)
+{
+  app->set_focus(x, y);
+}
+
+void entryHandler(int state)
+{
+  if (state == GLUT_LEFT) {
+    app->set_focus(glutGet(GLUT_WINDOW_WIDTH) / 2, glutGet(GLUT_WINDOW_HEIGHT) / 2);
+  }
+}
+
+void specialKeyHandler(int key, int, int)
+{
+  // An eighth of the window per key press.
+  const int step_x = glutGet(GLUT_WINDOW_WIDTH) / 8;
+  const int step_y = glutGet(GLUT_WINDOW_HEIGHT) / 8;
+  switch (key) {
+  case GLUT_KEY_LEFT:
+    app->pan(-step_x, 0);
+    break;
+  case GLUT_KEY_RIGHT:
+    app->pan(step_x, 0);
+    break;
+  case GLUT_KEY_UP:
+    app->pan(0, -step_y);
+    break;
+  case GLUT_KEY_DOWN:
+    app->pan(0, step_y);
+    break;
+  }
+}
+
+void keyHandler(unsigned char key, int, int)
+{
+  if (key == 'c') {
+    app->cycle_palette();
+  } else if (key == 's') {
+    app->view().toggle_overlay();
+    glutPostWindowRedisplay(main_window);
+  }
+}
+
+void reshapeHandler(int width, int height)
+{
+  glViewport(0, 0, width, height);
+  if (width > 0 && height > 0) {
+    app->resize(width, height);
+  }
+}
+
 void render_scene() {
   app->view().render_scene();
 }
@@ -56,15 +126,39 @@ int main(int argc, char* argv[])
   glutInitDisplayMode(GLUT_SINGLE | GLUT_RGBA);
   glutInitWindowPosition(100, 100);
 
-  constexpr std::uint32_t window_width = MandelbrotApp::Model::window_width;
-  constexpr std::uint32_t window_height = MandelbrotApp::Model::window_height;
+  constexpr std::uint32_t window_width = MandelbrotApp::Model::default_window_width;
+  constexpr std::uint32_t window_height = MandelbrotApp::Model::default_window_height;
   glutInitWindowSize(window_width, window_height);
   main_window = glutCreateWindow("Gradual Mandelbrot Rendering");
   
   app = std::make_unique<MandelbrotApp>();
+  if (const char* cache = std::getenv("MANDEL_TILE_CACHE")) {
+    app->set_tile_cache(cache);
+  }
+  if (const char* palette = std::getenv("MANDEL_PALETTE")) {
+    try {
+      app->set_palette(Palette::named(palette));
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+  if (const char* precision = std::getenv("MANDEL_PRECISION")) {
+    app->set_mixed_precision(std::strcmp(precision, "auto") == 0);
+  }
+  if (const char* path = std::getenv("MANDEL_STATS")) {
+    stats_log.open(path);
+    if (!stats_log) {
+      std::cerr << "cannot write stats to " << path << std::endl;
+    }
+  }
   glutDisplayFunc(render_scene);
-  glutIdleFunc(idleFunc);
+  glutTimerFunc(frame_poll_ms, pollFrames, 0);
   glutMouseFunc(mouseHandler);
+  glutPassiveMotionFunc(motionHandler);
+  glutEntryFunc(entryHandler);
+  glutSpecialFunc(specialKeyHandler);
+  glutKeyboardFunc(keyHandler);
+  glutReshapeFunc(reshapeHandler);
 
   glutInitWindowPosition(100 + window_width, 100);
   // Create additional window for looking at iterates.
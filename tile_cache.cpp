@@ -0,0 +1,131 @@
+#include "tile_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <utility>
+
+namespace {
+// File layout: a Header, the key bytes, padding to a multiple of four, then
+// the samples as native floats. Tiles are not portable between machines of
+// different byte order; the version check turns a byte-swapped tile into a
+// miss.
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t key_bytes;
+  std::uint64_t sample_count;
+};
+
+const char tile_magic[8] = { 'M', 'A', 'N', 'D', 'T', 'I', 'L', 'E' };
+constexpr std::uint32_t tile_version = 1;
+
+std::size_t samples_offset(std::size_t key_bytes)
+{
+  return (sizeof(Header) + key_bytes + 3) / 4 * 4;
+}
+
+// FNV-1a; only needs to spread keys over file names.
+std::uint64_t hash(const std::string& key)
+{
+  std::uint64_t h = 14695981039346656037ull;
+  for (const char c : key) {
+    h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+  }
+  return h;
+}
+}
+
+TileCache::TileCache(std::string directory)
+  : directory_(std::move(directory))
+{
+  mkdir(directory_.c_str(), 0777);
+}
+
+std::string TileCache::path_for(const std::string& key) const
+{
+  char name[32];
+  std::snprintf(name, sizeof name, "/%016llx.tile", static_cast<unsigned long long>(hash(key)));
+  return directory_ + name;
+}
+
+bool TileCache::load(const std::string& key, float* samples, std::size_t count) const
+{
+  const int fd = open(path_for(key).c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  const std::size_t bytes = samples_offset(key.size()) + count * sizeof(float);
+  if (fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) != bytes) {
+    ::close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  const char* base = static_cast<const char*>(data);
+  Header header;
+  std::memcpy(&header, base, sizeof header);
+  const bool match = std::memcmp(header.magic, tile_magic, sizeof tile_magic) == 0 &&
+                     header.version == tile_version &&
+                     header.key_bytes == key.size() &&
+                     header.sample_count == count &&
+                     key.compare(0, key.size(), base + sizeof header, key.size()) == 0;
+  if (match) {
+    std::memcpy(samples, base + samples_offset(key.size()), count * sizeof(float));
+  }
+  munmap(data, bytes);
+  return match;
+}
+
+bool TileCache::store(const std::string& key, const float* samples, std::size_t count) const
+{
+  // A name of our own, so that concurrent writers of the same tile cannot
+  // interleave; the last rename wins and every version is complete.
+  std::random_device entropy;
+  const std::string path = path_for(key);
+  const std::string temporary = path + "." + std::to_string(entropy()) + ".tmp";
+
+  const int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    return false;
+  }
+  const std::size_t offset = samples_offset(key.size());
+  const std::size_t bytes = offset + count * sizeof(float);
+  void* data = MAP_FAILED;
+  if (ftruncate(fd, bytes) == 0) {
+    data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  char* base = static_cast<char*>(data);
+  Header header;
+  std::memcpy(header.magic, tile_magic, sizeof tile_magic);
+  header.version = tile_version;
+  header.key_bytes = key.size();
+  header.sample_count = count;
+  std::memcpy(base, &header, sizeof header);
+  std::memcpy(base + sizeof header, key.data(), key.size());
+  std::memcpy(base + offset, samples, count * sizeof(float));
+  const bool written = msync(data, bytes, MS_SYNC) == 0;
+  munmap(data, bytes);
+
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// A directory of finished tiles that outlives the process and can be shared
+// between machines over a common filesystem. A tile holds the raw smooth
+// count of every sub-sample rather than colours, so a cached region can be
+// recoloured for free. Each tile is one file named after a hash of its key;
+// the full key is stored in the file too and checked on load, so a hash
+// collision is just a miss.
+//
+// Files are written to a temporary name and renamed into place, so readers
+// never see a partial tile, and are read through a read-only mapping. Cache
+// failures are never fatal: a tile that cannot be stored is simply not
+// cached, and one that cannot be read is a miss.
+class TileCache {
+public:
+  explicit TileCache(std::string directory);
+
+  // Copies the tile stored under key into samples, which must have room for
+  // count values. Returns false if there is no such tile or it does not
+  // hold exactly count values.
+  bool load(const std::string& key, float* samples, std::size_t count) const;
+  // Stores count values under key. Returns false if the tile could not be
+  // written.
+  bool store(const std::string& key, const float* samples, std::size_t count) const;
+
+  const std::string& directory() const { return directory_; }
+
+private:
+  std::string path_for(const std::string& key) const;
+
+private:
+  const std::string directory_;
+};
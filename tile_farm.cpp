@@ -0,0 +1,432 @@
+#include "tile_farm.h"
+#include "engine.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+enum MessageType : std::uint32_t {
+  // Coordinator to worker: the FarmView every later tile belongs to.
+  view_message = 1,
+  // Coordinator to worker: a tile to render.
+  tile_message = 2,
+  // Worker to coordinator: the tile rendered last, then its counts.
+  counts_message = 3,
+};
+
+struct MessageHeader {
+  std::uint32_t type;
+  std::uint32_t reserved;
+  std::uint64_t bytes;
+};
+
+bool write_all(int fd, const void* data, std::size_t bytes)
+{
+  const char* p = static_cast<const char*>(data);
+  while (bytes) {
+    const ssize_t written = write(fd, p, bytes);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    bytes -= written;
+  }
+  return true;
+}
+
+bool read_all(int fd, void* data, std::size_t bytes)
+{
+  char* p = static_cast<char*>(data);
+  while (bytes) {
+    const ssize_t got = read(fd, p, bytes);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    p += got;
+    bytes -= got;
+  }
+  return true;
+}
+
+// Builds the payload of a message, header first.
+class Encoder {
+public:
+  explicit Encoder(MessageType type)
+    : bytes_(sizeof(MessageHeader))
+  {
+    header().type = type;
+    header().reserved = 0;
+  }
+
+  template <typename T>
+  void put(const T& value)
+  {
+    const char* p = reinterpret_cast<const char*>(&value);
+    bytes_.insert(bytes_.end(), p, p + sizeof value);
+  }
+  void put_string(const std::string& s)
+  {
+    put(static_cast<std::uint32_t>(s.size()));
+    bytes_.insert(bytes_.end(), s.begin(), s.end());
+  }
+  void put_floats(const float* values, std::size_t count)
+  {
+    const char* p = reinterpret_cast<const char*>(values);
+    bytes_.insert(bytes_.end(), p, p + count * sizeof(float));
+  }
+
+  // The whole message, ready to write.
+  std::vector<char>& finish()
+  {
+    header().bytes = bytes_.size() - sizeof(MessageHeader);
+    return bytes_;
+  }
+
+private:
+  MessageHeader& header() { return *reinterpret_cast<MessageHeader*>(bytes_.data()); }
+
+private:
+  std::vector<char> bytes_;
+};
+
+// Reads the fields of a payload back in order.
+class Decoder {
+public:
+  explicit Decoder(const std::vector<char>& payload)
+    : p_(payload.data()), end_(payload.data() + payload.size())
+  {
+  }
+
+  template <typename T>
+  T get()
+  {
+    T value;
+    std::memcpy(&value, take(sizeof value), sizeof value);
+    return value;
+  }
+  std::string get_string()
+  {
+    const std::uint32_t size = get<std::uint32_t>();
+    const char* p = take(size);
+    return std::string(p, p + size);
+  }
+  const float* get_floats(std::size_t count)
+  {
+    return reinterpret_cast<const float*>(take(count * sizeof(float)));
+  }
+
+private:
+  const char* take(std::size_t bytes)
+  {
+    if (static_cast<std::size_t>(end_ - p_) < bytes) {
+      throw std::runtime_error("truncated tile farm message");
+    }
+    const char* p = p_;
+    p_ += bytes;
+    return p;
+  }
+
+private:
+  const char* p_;
+  const char* end_;
+};
+
+// Reads one message. False at end of file, on a broken pipe, or when the
+// header claims more than max_bytes of payload, which is then left unread.
+bool receive(int fd, MessageType& type, std::vector<char>& payload, std::uint64_t max_bytes)
+{
+  MessageHeader header;
+  if (!read_all(fd, &header, sizeof header) || header.bytes > max_bytes) {
+    return false;
+  }
+  type = static_cast<MessageType>(header.type);
+  payload.resize(header.bytes);
+  return read_all(fd, payload.data(), payload.size());
+}
+
+std::vector<char> encode_view(const FarmView& view)
+{
+  Encoder message(view_message);
+  message.put_string(view.real_center);
+  message.put_string(view.imag_center);
+  message.put(view.width);
+  message.put(view.image_width);
+  message.put(view.image_height);
+  message.put(view.iterations);
+  message.put(static_cast<std::uint32_t>(view.samples));
+  message.put(static_cast<std::uint8_t>(view.region_fill));
+  message.put(static_cast<std::uint8_t>(view.mixed_precision));
+  message.put(static_cast<std::uint32_t>(view.bin_width));
+  return message.finish();
+}
+
+FarmView decode_view(Decoder& message)
+{
+  FarmView view;
+  view.real_center = message.get_string();
+  view.imag_center = message.get_string();
+  view.width = message.get<double>();
+  view.image_width = message.get<std::uint32_t>();
+  view.image_height = message.get<std::uint32_t>();
+  view.iterations = message.get<std::uint64_t>();
+  view.samples = message.get<std::uint32_t>();
+  view.region_fill = message.get<std::uint8_t>();
+  view.mixed_precision = message.get<std::uint8_t>();
+  view.bin_width = message.get<std::uint32_t>();
+  return view;
+}
+}
+
+void serve_tiles(int in_fd, int out_fd, unsigned thread_count)
+{
+  MandelbrotEngine engine(1, 1, thread_count);
+  // Nobody is watching the intermediate frames, so passes can be long.
+  engine.set_frame_time_target(std::chrono::milliseconds(250));
+  FarmView view;
+  bool have_view = false;
+  std::vector<char> payload;
+  std::vector<float> counts;
+
+  // Views carry their centres in decimal, which can run to thousands of
+  // digits but not to megabytes.
+  constexpr std::uint64_t max_request = 1 << 20;
+  MessageType type;
+  while (receive(in_fd, type, payload, max_request)) {
+    Decoder message(payload);
+    if (type == view_message) {
+      view = decode_view(message);
+      engine.set_iteration_cap(view.iterations);
+      engine.set_samples(view.samples);
+      engine.set_region_fill(view.region_fill);
+      engine.set_mixed_precision(view.mixed_precision);
+      if (!engine.set_bin_width(view.bin_width)) {
+        throw std::runtime_error("unsupported bin width " + std::to_string(view.bin_width));
+      }
+      have_view = true;
+      continue;
+    }
+    if (type != tile_message || !have_view) {
+      throw std::runtime_error("unexpected tile farm message");
+    }
+    const std::uint32_t x = message.get<std::uint32_t>();
+    const std::uint32_t y = message.get<std::uint32_t>();
+    const std::uint32_t width = message.get<std::uint32_t>();
+    const std::uint32_t height = message.get<std::uint32_t>();
+
+    // The frame takes a pixel more on every side, so that the pixels on the
+    // tile's edge are refined by the same neighbours as in the whole view.
+    const double pixel_width = view.width / view.image_width;
+    const double x_offset = x + width / 2.0 - view.image_width / 2.0;
+    const double y_offset = y + height / 2.0 - view.image_height / 2.0;
+    engine.resize(width + 2, height + 2);
+    if (!engine.set_view(view.real_center, view.imag_center, (width + 2) * pixel_width,
+                         x_offset * pixel_width, -y_offset * pixel_width)) {
+      throw std::runtime_error("bad view centre " + view.real_center + "," + view.imag_center);
+    }
+    while (!engine.converged()) {
+      engine.run_pass();
+    }
+
+    counts.resize(std::size_t(width) * height * engine.samples());
+    engine.read_counts(1, 1, width, height, counts.data());
+    Encoder reply(counts_message);
+    reply.put(x);
+    reply.put(y);
+    reply.put(width);
+    reply.put(height);
+    reply.put_floats(counts.data(), counts.size());
+    const std::vector<char>& bytes = reply.finish();
+    if (!write_all(out_fd, bytes.data(), bytes.size())) {
+      throw std::runtime_error("cannot send tile");
+    }
+  }
+}
+
+TileFarm::TileFarm(const FarmView& view, const std::vector<std::string>& commands,
+                   std::uint32_t tile_width)
+  : view_(view)
+  , view_message_(encode_view(view))
+{
+  signal(SIGPIPE, SIG_IGN);
+
+  for (std::uint32_t y = 0; y < view.image_height; y += tile_width) {
+    for (std::uint32_t x = 0; x < view.image_width; x += tile_width) {
+      pending_.push_back(Tile{ x, y, std::min(tile_width, view.image_width - x),
+                               std::min(tile_width, view.image_height - y) });
+    }
+  }
+
+  workers_.resize(commands.size());
+  for (std::size_t i = 0; i < commands.size(); ++i) {
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) != 0) {
+      throw std::runtime_error("cannot create pipe");
+    }
+    if (pipe2(from, O_CLOEXEC) != 0) {
+      close(to[0]);
+      close(to[1]);
+      throw std::runtime_error("cannot create pipe");
+    }
+    const pid_t pid = fork();
+    if (pid == 0) {
+      // dup2 clears close-on-exec on the copies, and only on them.
+      dup2(to[0], STDIN_FILENO);
+      dup2(from[1], STDOUT_FILENO);
+      execl("/bin/sh", "sh", "-c", ("exec " + commands[i]).c_str(), static_cast<char*>(nullptr));
+      _exit(127);
+    }
+    close(to[0]);
+    close(from[1]);
+    Worker& worker = workers_[i];
+    worker.pid = pid;
+    worker.to = to[1];
+    worker.from = from[0];
+    if (pid < 0) {
+      ++workers_lost_;
+      reap(worker);
+    } else if (!write_all(worker.to, view_message_.data(), view_message_.size())) {
+      lose(worker);
+    }
+  }
+}
+
+TileFarm::~TileFarm()
+{
+  for (Worker& worker : workers_) {
+    reap(worker);
+  }
+}
+
+bool TileFarm::assign(Worker& worker)
+{
+  worker.tile = pending_.front();
+  pending_.pop_front();
+  worker.busy = true;
+
+  Encoder message(tile_message);
+  message.put(worker.tile.x);
+  message.put(worker.tile.y);
+  message.put(worker.tile.width);
+  message.put(worker.tile.height);
+  const std::vector<char>& bytes = message.finish();
+  if (!write_all(worker.to, bytes.data(), bytes.size())) {
+    lose(worker);
+    return false;
+  }
+  return true;
+}
+
+void TileFarm::lose(Worker& worker)
+{
+  ++workers_lost_;
+  if (worker.busy) {
+    pending_.push_front(worker.tile);
+    worker.busy = false;
+  }
+  // A worker that sent garbage may still be running.
+  if (worker.pid > 0) {
+    kill(worker.pid, SIGKILL);
+  }
+  reap(worker);
+}
+
+void TileFarm::reap(Worker& worker)
+{
+  if (worker.to >= 0) {
+    close(worker.to);
+  }
+  if (worker.from >= 0) {
+    close(worker.from);
+  }
+  if (worker.pid > 0) {
+    waitpid(worker.pid, nullptr, 0);
+  }
+  worker.to = worker.from = -1;
+  worker.pid = -1;
+}
+
+void TileFarm::render(const TileHandler& handler)
+{
+  std::vector<pollfd> polls;
+  std::vector<Worker*> polled;
+  std::vector<char> payload;
+
+  for (;;) {
+    for (Worker& worker : workers_) {
+      if (worker.pid > 0 && !worker.busy && !pending_.empty()) {
+        assign(worker);
+      }
+    }
+
+    polls.clear();
+    polled.clear();
+    for (Worker& worker : workers_) {
+      if (worker.busy) {
+        polls.push_back(pollfd{ worker.from, POLLIN, 0 });
+        polled.push_back(&worker);
+      }
+    }
+    if (polls.empty()) {
+      if (pending_.empty()) {
+        return;
+      }
+      throw std::runtime_error("every tile farm worker died");
+    }
+    if (poll(polls.data(), polls.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("poll failed");
+    }
+
+    for (std::size_t i = 0; i < polls.size(); ++i) {
+      if (!polls[i].revents) {
+        continue;
+      }
+      Worker& worker = *polled[i];
+      const Tile& tile = worker.tile;
+      // A reply is the tile's position and size, then its counts. Anything
+      // else, such as a worker printing stray output, loses the worker
+      // before any of it is allocated.
+      const std::uint64_t reply_bytes =
+          4 * sizeof(std::uint32_t) +
+          std::uint64_t(tile.width) * tile.height * view_.samples * sizeof(float);
+      MessageType type;
+      if (!receive(worker.from, type, payload, reply_bytes) || type != counts_message ||
+          payload.size() != reply_bytes) {
+        lose(worker);
+        continue;
+      }
+      const float* counts = nullptr;
+      try {
+        Decoder message(payload);
+        if (message.get<std::uint32_t>() == tile.x && message.get<std::uint32_t>() == tile.y &&
+            message.get<std::uint32_t>() == tile.width &&
+            message.get<std::uint32_t>() == tile.height) {
+          counts = message.get_floats(std::size_t(tile.width) * tile.height * view_.samples);
+        }
+      } catch (const std::runtime_error&) {
+      }
+      if (!counts) {
+        lose(worker);
+        continue;
+      }
+      worker.busy = false;
+      handler(tile.x, tile.y, tile.width, tile.height, counts);
+    }
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Renders one view across several processes, on this machine or others. A
+// coordinator (TileFarm) splits the view into tiles and hands them out one
+// at a time to worker processes over their standard input; each worker
+// (serve_tiles) renders its tiles with a MandelbrotEngine of its own and
+// writes back the smooth count of every sub-sample, which the coordinator
+// colours. A worker that exits, or answers with anything but the tile it was
+// asked for, has its tile handed to another.
+//
+// Messages are a type, a payload size and the payload, all native-endian,
+// so workers on other machines must share the coordinator's byte order.
+// Errors are reported by throwing std::runtime_error.
+
+// Everything a worker needs to render any tile of a view.
+struct FarmView {
+  std::string real_center = "-0.85";
+  std::string imag_center = "0";
+  double width = 2.8;
+  std::uint32_t image_width = 800;
+  std::uint32_t image_height = 800;
+  std::uint64_t iterations = 100000;
+  unsigned samples = 8;
+  bool region_fill = true;
+  bool mixed_precision = false;
+  // See MandelbrotEngine::set_bin_width(); must be supported.
+  unsigned bin_width = 4;
+};
+
+// Answers tile requests read from in_fd on out_fd until in_fd reaches end
+// of file. thread_count is as for MandelbrotEngine.
+void serve_tiles(int in_fd, int out_fd, unsigned thread_count);
+
+class TileFarm {
+public:
+  // Receives a finished tile: its position and size in pixels, and its
+  // counts, view.samples per pixel, row by row.
+  typedef std::function<void(std::uint32_t x, std::uint32_t y, std::uint32_t width,
+                             std::uint32_t height, const float* counts)> TileHandler;
+
+  // Starts one worker per command, each run by /bin/sh -c with its standard
+  // input and output connected to the coordinator, such as
+  // "ssh node2 mandel_render --serve". Tiles are tile_width pixels square,
+  // less at the right and bottom edges. Ignores SIGPIPE from then on, so
+  // that a worker dying cannot take the coordinator with it.
+  TileFarm(const FarmView& view, const std::vector<std::string>& commands,
+           std::uint32_t tile_width = 256);
+  // Closes the workers' input, which ends them, and waits for them.
+  ~TileFarm();
+  TileFarm(const TileFarm&) = delete;
+  TileFarm& operator=(const TileFarm&) = delete;
+
+  // Renders every tile of the view, calling handler for each as it
+  // arrives, in no particular order. Throws if every worker has died with
+  // tiles still to render.
+  void render(const TileHandler& handler);
+  // Workers that died so far.
+  unsigned workers_lost() const { return workers_lost_; }
+
+private:
+  struct Tile {
+    std::uint32_t x, y, width, height;
+  };
+  struct Worker {
+    pid_t pid = -1;
+    // Its standard input and output.
+    int to = -1;
+    int from = -1;
+    bool busy = false;
+    Tile tile;
+  };
+
+  // Sends the tile at the front of pending_ to worker. False if the
+  // worker is lost instead.
+  bool assign(Worker& worker);
+  // Stops a worker that failed and puts its tile back at the front.
+  void lose(Worker& worker);
+  // Closes the worker's pipes and waits for it to exit.
+  void reap(Worker& worker);
+
+private:
+  const FarmView view_;
+  std::vector<char> view_message_;
+  std::vector<Worker> workers_;
+  std::deque<Tile> pending_;
+  unsigned workers_lost_ = 0;
+};
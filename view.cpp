@@ -1,9 +1,12 @@
 #include "view.h"
 #include "app.h"
 
-#include <GL/gl.h>
+#include <GL/glut.h>
+#include <algorithm>
+#include <cstdio>
+#include <string>
 
-MandelbrotView::MandelbrotView(const MandelbrotApp& parent)
+MandelbrotView::MandelbrotView(MandelbrotApp& parent)
   : parent_(parent)
 {
   glEnable(GL_TEXTURE_2D);
@@ -55,17 +58,127 @@ void MandelbrotView::render_iterates()
   glEnd();
 }
 
+void MandelbrotView::upload(const MandelbrotEngine::Frame& frame)
+{
+  const auto start = std::chrono::steady_clock::now();
+  // Rows are tightly packed; the width need not be a multiple of 4.
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  constexpr GLint level = 0;
+  if (frame.width != texture_width_ || frame.height != texture_height_) {
+    constexpr GLint border = 0;
+    glTexImage2D(GL_TEXTURE_2D, level, GL_RGB8,
+                 frame.width, frame.height,
+                 border, GL_RGB,
+                 GL_UNSIGNED_BYTE, frame.texture_data.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    texture_width_ = frame.width;
+    texture_height_ = frame.height;
+    texture_versions_ = frame.tile_versions;
+    upload_time_ += std::chrono::steady_clock::now() - start;
+    ++uploads_;
+    return;
+  }
+
+  // Each run of changed tiles along a row of tiles is one upload, read
+  // straight out of the full frame.
+  constexpr unsigned tile_width = MandelbrotEngine::Frame::tile_width;
+  const unsigned tiles_wide = frame.tiles_wide();
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.width);
+  for (std::size_t tile = 0; tile < texture_versions_.size(); ++tile) {
+    std::size_t end = tile;
+    while (end < texture_versions_.size() && end / tiles_wide == tile / tiles_wide &&
+           texture_versions_[end] != frame.tile_versions[end]) {
+      texture_versions_[end] = frame.tile_versions[end];
+      ++end;
+    }
+    if (end == tile) {
+      continue;
+    }
+    const GLint x = tile % tiles_wide * tile_width;
+    const GLint y = tile / tiles_wide * tile_width;
+    const GLsizei width = std::min<GLint>((end - 1) % tiles_wide * tile_width + tile_width,
+                                          frame.width) - x;
+    const GLsizei height = std::min<GLint>(y + tile_width, frame.height) - y;
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+    glTexSubImage2D(GL_TEXTURE_2D, level, x, y, width, height,
+                    GL_RGB, GL_UNSIGNED_BYTE, frame.texture_data.data());
+    tile = end - 1;
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+  upload_time_ += std::chrono::steady_clock::now() - start;
+  ++uploads_;
+}
+
+void MandelbrotView::render_overlay(const MandelbrotEngine::Stats& stats)
+{
+  auto ms = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  const double passes = std::max<double>(stats.passes, 1);
+  const double iterate_seconds = std::max(ms(stats.iterate) / 1000.0, 1e-9);
+  std::vector<std::string> lines;
+  char line[128];
+  std::snprintf(line, sizeof line, "passes %llu  live bins %zu",
+                static_cast<unsigned long long>(stats.passes), stats.live_bins);
+  lines.push_back(line);
+  std::snprintf(line, sizeof line, "iterations %.4g  (%.4g/s iterating)",
+                static_cast<double>(stats.iterations()), stats.iterations() / iterate_seconds);
+  lines.push_back(line);
+  std::snprintf(line, sizeof line, "pixels final %llu  filled %llu",
+                static_cast<unsigned long long>(stats.pixels_finalized()),
+                static_cast<unsigned long long>(stats.pixels_filled));
+  lines.push_back(line);
+  std::snprintf(line, sizeof line, "ms/pass  queue %.2f  iterate %.2f  colour %.2f",
+                ms(stats.queue) / passes, ms(stats.iterate) / passes,
+                ms(stats.colour) / passes);
+  lines.push_back(line);
+  // Uploads happen once per displayed frame, not once per pass.
+  std::snprintf(line, sizeof line, "ms/upload %.2f  uploads %llu",
+                ms(stats.upload) / std::max<double>(uploads_, 1),
+                static_cast<unsigned long long>(uploads_));
+  lines.push_back(line);
+  for (std::size_t t = 0; t < stats.workers.size(); ++t) {
+    const MandelbrotEngine::WorkerStats& w = stats.workers[t];
+    std::snprintf(line, sizeof line, "worker %zu  busy %.0f%%  bins %llu", t,
+                  100.0 * ms(w.busy) / std::max(ms(stats.iterate), 1e-9),
+                  static_cast<unsigned long long>(w.bins));
+    lines.push_back(line);
+  }
+
+  // Text is placed in window pixels, on a dark box so it stays legible.
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  const double pixel_x = 2.0 / std::max(viewport[2], 1);
+  const double pixel_y = 2.0 / std::max(viewport[3], 1);
+  constexpr int line_height = 13;
+  constexpr int char_width = 8;
+  std::size_t longest = 0;
+  for (const std::string& l : lines) {
+    longest = std::max(longest, l.size());
+  }
+  glDisable(GL_TEXTURE_2D);
+  glColor3f(0.0f, 0.0f, 0.0f);
+  glRectd(-1.0, 1.0, -1.0 + (longest * char_width + 8) * pixel_x,
+          1.0 - (lines.size() * line_height + 8) * pixel_y);
+  glColor3f(1.0f, 1.0f, 1.0f);
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    glRasterPos2d(-1.0 + 4 * pixel_x, 1.0 - (4 + (i + 1) * line_height - 3) * pixel_y);
+    for (const char c : lines[i]) {
+      glutBitmapCharacter(GLUT_BITMAP_8_BY_13, c);
+    }
+  }
+  glEnable(GL_TEXTURE_2D);
+}
+
 void MandelbrotView::render_scene()
 {
   glBindTexture(GL_TEXTURE_2D, mandel_texture_);
-  constexpr GLint level = 0;
-  constexpr GLint border = 0;
-  glTexImage2D(GL_TEXTURE_2D, level, GL_RGB8,
-               parent_.model().window_width, parent_.model().window_height,
-               border, GL_RGB,
-               GL_UNSIGNED_BYTE, parent_.model().texture_data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  parent_.update_frame();
+  this->upload(parent_.frame());
 
   glBegin(GL_QUADS);
   glTexCoord2f(0.0f, 1.0f); glVertex3f(-1.0f, -1.0f,  1.0f);
@@ -73,5 +186,8 @@ void MandelbrotView::render_scene()
   glTexCoord2f(1.0f, 0.0f); glVertex3f( 1.0f,  1.0f,  1.0f);
   glTexCoord2f(0.0f, 0.0f); glVertex3f(-1.0f,  1.0f,  1.0f);
   glEnd();
+  if (overlay_) {
+    this->render_overlay(parent_.stats());
+  }
   glFlush();
 }
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <vector>
+#include "engine.h"
 
 class MandelbrotApp;
 
@@ -10,12 +13,31 @@ using TextureHandle = std::uint32_t;
 class MandelbrotView {
 public:
   // Assumes initialized GL context.
-  MandelbrotView(const MandelbrotApp& parent);
+  MandelbrotView(MandelbrotApp& parent);
 
   void render_iterates();
   void render_scene();
+  // Shows or hides the engine stats over the scene.
+  void toggle_overlay() { overlay_ = !overlay_; }
+  // Total time spent in upload() so far.
+  std::chrono::steady_clock::duration upload_time() const { return upload_time_; }
 
 private:
-  const MandelbrotApp& parent_;
+  // Brings the texture up to date with the app's current frame, uploading
+  // only the tiles whose version changed since they were last uploaded.
+  void upload(const MandelbrotEngine::Frame& frame);
+  // Draws stats as text in the top left corner, over whatever is there.
+  void render_overlay(const MandelbrotEngine::Stats& stats);
+
+private:
+  MandelbrotApp& parent_;
   TextureHandle mandel_texture_;
+  std::uint32_t texture_width_ = 0;
+  std::uint32_t texture_height_ = 0;
+  // Version of every tile as last uploaded; see MandelbrotEngine::Frame.
+  std::vector<std::uint64_t> texture_versions_;
+  std::chrono::steady_clock::duration upload_time_{};
+  // Calls to upload() that upload_time_ covers.
+  std::uint64_t uploads_ = 0;
+  bool overlay_ = false;
 };